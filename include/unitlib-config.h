@@ -6,6 +6,42 @@
  */
 //#define UL_HAS_LONG_DOUBLE
 
+/**
+ * To disable the SSE2 tokenizer (e.g. for memory checkers, which don't like
+ * the aligned reads beyond the end of a string) uncomment the following line
+ */
+//#define UL_NO_SIMD
+
+/**
+ * To keep the power of ten of unit factors as a separate integer exponent
+ * (unit_t.scale) uncomment the following line. Prefixes then only change
+ * the exponent, and factors that differ only by prefixes compare exactly.
+ */
+//#define UL_HAS_DECIMAL_EXPONENT
+
+/**
+ * To remove all debug messages at compile time uncomment the following line.
+ * ul_debugging and friends still exist, but no messages are written.
+ */
+//#define UL_NO_DEBUG
+
+/**
+ * To add static tracepoints (USDT, provider "unitlib") for perf, bpftrace or
+ * SystemTap uncomment the following line. Needs <sys/sdt.h> (systemtap-sdt-dev).
+ * A tracepoint nobody is attached to is a single nop. The probes are named
+ * parse__begin, parse__end, item, rule__add, rule__remove, load__begin,
+ * load__end, print and error, and that is how perf and bpftrace list them,
+ * e.g. "bpftrace -e 'usdt:./prog:unitlib:parse__begin { ... }'". Only DTrace
+ * shows "__" as "-" (parse-begin).
+ */
+//#define UL_HAS_TRACEPOINTS
+
+/**
+ * To build without pthreads uncomment the following line. ul_load_rules_parallel
+ * then loads the rules like ul_load_rules.
+ */
+//#define UL_NO_THREADS
+
 // Don't change anything beyond this line
 //-----------------------------------------------------------------------------
 
@@ -15,7 +51,7 @@ typedef long double ul_number;
 #define _strton strtold
 #define _fabsn  fabsl
 #define _sqrtn  sqrtl
-#define _pown   pow
+#define _pown   powl
 
 #define N_FMT     "%Lg"
 #define N_EPSILON LDBL_EPSILON
@@ -26,7 +62,7 @@ typedef double ul_number;
 #define _strton strtod
 #define _fabsn  fabs
 #define _sqrtn  sqrt
-#define _pown   powl
+#define _pown   pow
 
 #define N_FMT     "%g"
 #define N_EPSILON DBL_EPSILON
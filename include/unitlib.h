@@ -6,6 +6,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "unitlib-config.h"
@@ -60,8 +61,136 @@ typedef struct unit
 {
 	int exps[NUM_BASE_UNITS];
 	ul_number factor;
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	int scale; // the real factor is factor * 10^scale
+#endif
 } unit_t;
 
+// Maximal size of an encoded unit, see ul_encode
+#define UL_ENCODED_MAX 64
+
+// Id of an interned unit, see ul_intern
+typedef uint32_t ul_unit_id;
+#define UL_NO_UNIT ((ul_unit_id)0)
+
+// A set of rules, see ul_ruleset_new
+typedef struct ul_ruleset ul_ruleset_t;
+
+typedef struct ul_cache_stats
+{
+	unsigned long hits;    // unknown symbols rejected by the cache
+	unsigned long misses;  // symbols that had to be looked up
+	unsigned long inserts; // unknown symbols added to the cache
+	unsigned long flushes; // invalidations due to changed rules
+} ul_cache_stats_t;
+
+// Memory in bytes, see ul_memory_usage
+typedef struct ul_memory
+{
+	size_t rules;    // rules incl. the base rules and what they use
+	size_t symbols;  // symbols and definitions of the rules
+	size_t prefixes;
+	size_t index;    // symbol lookup (trie)
+	size_t cache;    // cache for unknown symbols
+	size_t units;    // interned units and their strings
+	size_t other;    // counters, latency histograms, debug buffer
+	size_t total;
+} ul_memory_t;
+
+// Allocator callbacks, see ul_set_allocator
+typedef void *(*ul_malloc_f)(size_t size, void *user);
+typedef void *(*ul_realloc_f)(void *ptr, size_t size, void *user);
+typedef void  (*ul_free_f)(void *ptr, void *user);
+
+// Sources of debug messages, see ul_debuglevel
+typedef enum ul_dbgcat
+{
+	UL_DBG_CORE = 0, // init and setup
+	UL_DBG_PARSER,   // units and rules
+	UL_DBG_NUMBER,   // number parsing
+	UL_NUM_DBGCATS,
+} ul_dbgcat_t;
+
+typedef enum ul_dbglevel
+{
+	UL_DBG_OFF = 0,
+	UL_DBG_INFO,  // one message per call
+	UL_DBG_TRACE, // messages for every item
+} ul_dbglevel_t;
+
+// Kinds of errors, see ul_stats
+typedef enum ul_errkind
+{
+	UL_ERR_PARAM = 0, // invalid parameters
+	UL_ERR_SYNTAX,    // malformed unit strings
+	UL_ERR_SYMBOL,    // unknown symbols
+	UL_ERR_RULE,      // invalid rules
+	UL_ERR_MATH,      // impossible operations
+	UL_ERR_ENCODING,  // malformed encoded units
+	UL_ERR_MEMORY,    // out of memory
+	UL_ERR_IO,        // failed file operations
+	UL_ERR_INTERNAL,  // bugs
+	UL_NUM_ERRKINDS,
+} ul_errkind_t;
+
+typedef struct ul_stats
+{
+	unsigned long parse_calls;    // calls of ul_parse
+	unsigned long tokens;         // items handled by the parser
+	unsigned long rule_lookups;   // symbols looked up in the rules
+	unsigned long rule_misses;    // ... that were unknown
+	unsigned long prefix_lookups; // ... that needed a prefix
+	unsigned long reduce_calls;   // units looked up for a reduced symbol
+	unsigned long reduce_hits;    // ... that had one
+	unsigned long format_calls;   // units formatted (incl. ul_length)
+	unsigned long format_bytes;   // characters produced by formatting
+	unsigned long errors[UL_NUM_ERRKINDS];
+} ul_stats_t;
+
+// Operations with latency histograms, see ul_latency
+typedef enum ul_latop
+{
+	UL_LAT_PARSE = 0,  // ul_parse
+	UL_LAT_PARSE_RULE, // ul_parse_rule
+	UL_LAT_LOAD_RULES, // ul_load_rules and ul_load_rules_parallel
+	UL_LAT_PRINT,      // ul_fprint and ul_snprint
+	UL_NUM_LATOPS,
+} ul_latop_t;
+
+// Summary of a latency histogram, all times in nanoseconds. The values are
+// precise to about 6%.
+typedef struct ul_latency
+{
+	uint64_t count; // sampled operations
+	uint64_t min;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+} ul_latency_t;
+
+/**
+ * Sets the functions all memory of the unitlib comes from. Has to be called
+ * before ul_init (and ul_debugbuffer) or after ul_quit, fails while memory
+ * of the old allocator is still in use, like rule sets other threads hold.
+ * Resets the counters of ul_stats. All NULL restores the C library.
+ * @param m    Allocates size bytes, like malloc
+ * @param r    Resizes ptr (never NULL), like realloc
+ * @param f    Releases ptr (never NULL), like free
+ * @param user Passed to every call
+ * @return success
+ */
+UL_API bool ul_set_allocator(ul_malloc_f m, ul_realloc_f r, ul_free_f f, void *user);
+
+/**
+ * Returns the memory used by the unitlib, as requested from the allocator
+ * (without its overhead) plus the static tables that grow with use
+ * @param mem The usage will be stored here
+ */
+UL_API void ul_memory_usage(ul_memory_t *mem);
+
 /**
  * Initializes the unitlib. Has to be called before any
  * other ul_* function (excl. the ul_debug* functions).
@@ -81,12 +210,35 @@ UL_API void ul_quit(void);
  */
 UL_API void ul_debugging(bool flag);
 
+/**
+ * Sets the verbosity of a single source of debug messages
+ * @param cat   The category
+ * @param level The highest level that is written
+ */
+UL_API void ul_debuglevel(ul_dbgcat_t cat, ul_dbglevel_t level);
+
 /**
  * Sets the debug output stream
  * @param out The outstream
  */
 UL_API void ul_debugout(const char *path, bool append);
 
+/**
+ * Collects debug messages in a ring buffer instead of writing each one.
+ * The buffer is written by ul_debugflush, by ul_quit and, unless keep_last
+ * is set, whenever it is full. With keep_last the oldest messages are
+ * dropped instead, so only the most recent ones are written.
+ * @param size      Size of the buffer in bytes, 0 writes every message at once
+ * @param keep_last Drop old messages instead of writing a full buffer
+ * @return success
+ */
+UL_API bool ul_debugbuffer(size_t size, bool keep_last);
+
+/**
+ * Writes all buffered debug messages, see ul_debugbuffer
+ */
+UL_API void ul_debugflush(void);
+
 /**
  * Returns the full name of unitlib, including the version
  * @return String in the form "unitlib-x.yz"
@@ -100,25 +252,158 @@ UL_API const char *ul_get_name(void);
 UL_API const char *ul_get_version(void);
 
 /**
- * Returns the last error message
+ * Returns the last error message of the calling thread
  * @return The last error message
  */
 UL_API const char *ul_error(void);
 
 /**
- * Parses a rule and adds it to the rule list
+ * Parses a rule and adds it to the rule list. A forced rule ("!N = ...")
+ * may replace a rule that isn't forced, the rules that use the old one are
+ * recomputed with the new one then. Other threads that use the rules
+ * meanwhile wait until the rule is added.
  * @param rule The rule to parse
  * @return success
  */
 UL_API bool ul_parse_rule(const char *rule);
 
 /**
- * Loads a rule file
+ * Loads a rule file. Other threads that use the rules meanwhile wait until
+ * the file is loaded.
  * @param path Path to the file
  * @return success
  */
 UL_API bool ul_load_rules(const char *path);
 
+/**
+ * Loads a rule file with the same result as ul_load_rules, but parses rules
+ * that don't depend on each other with several threads at the same time.
+ * Files with forced or redefined rules, symbols used before their definition
+ * or errors are loaded by ul_load_rules.
+ * @param path Path to the file
+ * @param threads Number of threads, 0 for one per CPU
+ * @return success
+ */
+UL_API bool ul_load_rules_parallel(const char *path, unsigned threads);
+
+/**
+ * Removes all rules added by ul_parse_rule or ul_load_rules, also detaches
+ * rules attached with ul_attach_rules. The rules are replaced like by
+ * ul_ruleset_swap, so other threads may parse meanwhile.
+ * @return success
+ */
+UL_API bool ul_reset_rules(void);
+
+/**
+ * Writes the current rules to a file other processes can attach with
+ * ul_attach_rules. The file is replaced atomically.
+ * @param path Path to the file
+ * @return success
+ */
+UL_API bool ul_publish_rules(const char *path);
+
+/**
+ * Replaces the rules with the ones published to a file. The file is mapped
+ * read only and its memory is shared by all processes that attach it, so it
+ * must not be changed in place. Until ul_reset_rules, ul_parse_rule and
+ * ul_load_rules fail. Every index in the file is checked first, which takes
+ * time linear in its size. The rules are replaced like by ul_ruleset_swap.
+ * Needs mmap (POSIX).
+ * @param path Path to the file
+ * @return success
+ */
+UL_API bool ul_attach_rules(const char *path);
+
+/**
+ * Creates a rule set with only the base units, that can be filled with
+ * ul_ruleset_parse_rule and ul_ruleset_load_rules while the current set
+ * is still in use, and then be made current with ul_ruleset_swap.
+ * @return The new set, free it with ul_ruleset_free
+ */
+UL_API ul_ruleset_t *ul_ruleset_new(void);
+
+/**
+ * Returns the rule set ul_parse and the other functions use
+ * @return A new reference to the set, free it with ul_ruleset_free
+ */
+UL_API ul_ruleset_t *ul_ruleset_current(void);
+
+/**
+ * Releases a reference to a rule set, the last one frees it
+ * @param set The set, may be NULL
+ */
+UL_API void ul_ruleset_free(ul_ruleset_t *set);
+
+/**
+ * Like ul_parse_rule, but adds the rule to set. Threads that parse with set
+ * wait meanwhile.
+ * @param set The set
+ * @param rule The rule
+ * @return success
+ */
+UL_API bool ul_ruleset_parse_rule(ul_ruleset_t *set, const char *rule);
+
+/**
+ * Like ul_load_rules, but adds the rules to set. Threads that parse with set
+ * wait meanwhile.
+ * @param set The set
+ * @param path Path to the file
+ * @return success
+ */
+UL_API bool ul_ruleset_load_rules(ul_ruleset_t *set, const char *path);
+
+/**
+ * Makes set the current rule set. Calls that already run finish with the
+ * previous set, it is freed when the last of them is done. Can be called
+ * while other threads parse.
+ * @param set The set, the caller keeps its reference
+ * @return success
+ */
+UL_API bool ul_ruleset_swap(ul_ruleset_t *set);
+
+/**
+ * Returns the counters of the cache for unknown symbols, summed up over all
+ * threads
+ * @param stats The counters will be stored here
+ * @param reset Start counting from zero again after reading them
+ */
+UL_API void ul_cache_stats(ul_cache_stats_t *stats, bool reset);
+
+/**
+ * Returns the counters of the library, summed up over all threads
+ * @param stats The counters will be stored here
+ * @param reset Start counting from zero again after reading them
+ */
+UL_API void ul_stats(ul_stats_t *stats, bool reset);
+
+/**
+ * Enables latency histograms. Every n-th operation of a thread is timed.
+ * Sampling is off by default.
+ * @param every Sampling interval, 1 times every operation, 0 disables
+ */
+UL_API void ul_latency_sampling(unsigned every);
+
+/**
+ * Clears all latency histograms
+ */
+UL_API void ul_latency_reset(void);
+
+/**
+ * Summarizes the latency histogram of an operation
+ * @param op  The operation
+ * @param out The summary will be stored here
+ * @return success
+ */
+UL_API bool ul_latency(ul_latop_t op, ul_latency_t *out);
+
+/**
+ * Writes all latency histograms
+ * @param f    The output stream
+ * @param json Write JSON including all buckets instead of a text summary
+ * @return success
+ */
+UL_API bool ul_latency_dump(FILE *f, bool json);
+
 /**
  * Parses the unit definition from str to unit
  * @param str  The unit definition
@@ -132,12 +417,16 @@ UL_API bool ul_parse(const char *str, unit_t *unit);
  * @param unit The unit
  * @return The factor
  */
+#ifdef UL_HAS_DECIMAL_EXPONENT
+UL_API ul_number ul_factor(const unit_t *unit);
+#else
 static inline ul_number ul_factor(const unit_t *unit)
 {
 	if (!unit)
 		return 0.0;
 	return unit->factor;
 }
+#endif
 
 /**
  * Compares two units
@@ -245,4 +534,68 @@ UL_API bool ul_snprint(char *buffer, size_t buflen, const unit_t *unit, ul_forma
  */
 UL_API size_t ul_length(const unit_t *unit, ul_format_t format, int fops);
 
+/**
+ * Returns the id of a unit. Units with the same exponents and exactly the
+ * same factor get the same id, so ids can be compared instead of units.
+ * Ids stay valid until ul_quit.
+ * @param unit The unit
+ * @return The id or UL_NO_UNIT if an error occured
+ */
+UL_API ul_unit_id ul_intern(const unit_t *unit);
+
+/**
+ * Returns the unit to an id
+ * @param id The id
+ * @return The unit or NULL if the id is invalid
+ */
+UL_API const unit_t *ul_unit(ul_unit_id id);
+
+/**
+ * Returns the symbol of the composed unit an interned unit reduces to. The
+ * string is cached, it stays valid until the rules change.
+ * @param id The id
+ * @return The symbol or NULL if the unit is not reduceable
+ */
+UL_API const char *ul_unit_symbol(ul_unit_id id);
+
+/**
+ * Returns an interned unit formated according to the format. The string is
+ * cached, it stays valid until the rules change.
+ * @param id     The id
+ * @param format The format
+ * @param fops   A bitmap containing UL_FOP_* flags
+ * @return The formated unit or NULL if an error occured
+ */
+UL_API const char *ul_unit_string(ul_unit_id id, ul_format_t format, int fops);
+
+/**
+ * Encodes a unit into a compact, versioned binary form
+ * @param unit   The unit
+ * @param buffer The buffer, UL_ENCODED_MAX bytes are always enough
+ * @param buflen Length of the buffer
+ * @return Number of bytes written, 0 if an error occured
+ */
+UL_API size_t ul_encode(const unit_t *unit, void *buffer, size_t buflen);
+
+/**
+ * Decodes a unit encoded by ul_encode
+ * @param buffer The encoded unit
+ * @param buflen Length of the buffer, it may contain more data after the unit
+ * @param unit   The decoded unit will be stored here
+ * @return Number of bytes read, 0 if an error occured
+ */
+UL_API size_t ul_decode(const void *buffer, size_t buflen, unit_t *unit);
+
+/**
+ * Decodes consecutive units encoded by ul_encode, directly from the buffer
+ * @param buffer The encoded units
+ * @param buflen Length of the buffer
+ * @param units  The decoded units will be stored here
+ * @param max    Maximal number of units to decode
+ * @param used   Number of bytes read, may be NULL
+ * @return Number of decoded units, if it is less than max and not all of
+ *         the buffer was used an error occured
+ */
+UL_API size_t ul_decode_all(const void *buffer, size_t buflen, unit_t *units, size_t max, size_t *used);
+
 #endif /*UNITLIB_H*/
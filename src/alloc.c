@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "unitlib.h"
+
+static void *std_malloc(size_t size, void *user)
+{
+	(void)user;
+	return malloc(size);
+}
+
+static void *std_realloc(void *ptr, size_t size, void *user)
+{
+	(void)user;
+	return realloc(ptr, size);
+}
+
+static void std_free(void *ptr, void *user)
+{
+	(void)user;
+	free(ptr);
+}
+
+static ul_malloc_f  alloc_malloc  = std_malloc;
+static ul_realloc_f alloc_realloc = std_realloc;
+static ul_free_f    alloc_free    = std_free;
+static void         *alloc_user   = NULL;
+
+// Blocks not freed yet, they have to go back to the allocator they came from
+static size_t num_blocks = 0;
+
+#ifdef __GNUC__
+#define COUNT_BLOCK(d) __atomic_add_fetch(&num_blocks, (d), __ATOMIC_RELAXED)
+#else
+#define COUNT_BLOCK(d) (num_blocks += (d))
+#endif
+
+UL_API bool ul_set_allocator(ul_malloc_f m, ul_realloc_f r, ul_free_f f, void *user)
+{
+	if (!m && !r && !f) {
+		m = std_malloc;
+		r = std_realloc;
+		f = std_free;
+		user = NULL;
+	}
+	else if (!m || !r || !f) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+
+	if (_ul_initialized) {
+		ERROR(UL_ERR_PARAM, "The allocator cannot change before ul_quit");
+		return false;
+	}
+	// the counters are allocated on demand, give them back to their allocator
+	_ul_free_stats();
+	if (num_blocks) {
+		ERROR(UL_ERR_PARAM, "%zu blocks of the old allocator are still in use", num_blocks);
+		return false;
+	}
+
+	alloc_malloc  = m;
+	alloc_realloc = r;
+	alloc_free    = f;
+	alloc_user    = user;
+	return true;
+}
+
+UL_LINKAGE void *_ul_malloc(size_t size)
+{
+	void *ptr = alloc_malloc(size, alloc_user);
+	if (ptr)
+		COUNT_BLOCK(1);
+	return ptr;
+}
+
+UL_LINKAGE void *_ul_calloc(size_t num, size_t size)
+{
+	if (size && num > SIZE_MAX / size)
+		return NULL;
+	void *ptr = _ul_malloc(num * size);
+	if (ptr)
+		memset(ptr, 0, num * size);
+	return ptr;
+}
+
+UL_LINKAGE void *_ul_realloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		return _ul_malloc(size);
+	return alloc_realloc(ptr, size, alloc_user);
+}
+
+UL_LINKAGE void _ul_free(void *ptr)
+{
+	if (ptr) {
+		alloc_free(ptr, alloc_user);
+		COUNT_BLOCK((size_t)-1);
+	}
+}
+
+UL_LINKAGE char *_ul_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = _ul_malloc(len);
+	if (copy)
+		memcpy(copy, str, len);
+	return copy;
+}
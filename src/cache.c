@@ -0,0 +1,90 @@
+#include <assert.h>
+#include <string.h>
+#include "intern.h"
+#include "unitlib.h"
+
+enum {
+	CACHE_SIZE    = 64, // Number of cached symbols, a power of two
+	MAX_CACHE_SYM = 23, // Longer symbols are not cached
+};
+
+// A recently unknown symbol
+struct entry
+{
+	unsigned      gen; // generation of the rules, 0 for empty entries
+	unsigned char len;
+	char          sym[MAX_CACHE_SYM];
+};
+
+// Entries of other rule generations are stale, so a flush costs nothing.
+// Every thread has its own cache, so parsing needs no locks. The counters
+// are summed up over all threads, see stats.c.
+static UL_THREAD_LOCAL struct entry cache[CACHE_SIZE];
+
+// Changes when the rule generations wrap around, old entries could look
+// valid again then. Every thread empties its cache when it sees that.
+static unsigned epoch = 0;
+static UL_THREAD_LOCAL unsigned local_epoch = 0;
+
+#ifdef __GNUC__
+#define LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_INC(x)   __sync_add_and_fetch(&(x), 1)
+#else
+#define LOAD_ACQUIRE(x) (x)
+#define ATOMIC_INC(x)   (++(x))
+#endif
+
+// FNV-1a
+static inline unsigned hash(const char *sym, size_t len)
+{
+	unsigned h = 2166136261u;
+	for (size_t i=0; i < len; ++i) {
+		h ^= (unsigned char)sym[i];
+		h *= 16777619u;
+	}
+	return h & (CACHE_SIZE - 1);
+}
+
+UL_LINKAGE bool _ul_cache_lookup(const char *sym, size_t len, unsigned gen)
+{
+	assert(sym);
+	unsigned cur = LOAD_ACQUIRE(epoch);
+	if (local_epoch != cur) {
+		memset(cache, 0, sizeof(cache));
+		local_epoch = cur;
+	}
+	if (len <= MAX_CACHE_SYM) {
+		struct entry *e = &cache[hash(sym, len)];
+		if (e->gen == gen && e->len == len && memcmp(e->sym, sym, len) == 0) {
+			CACHE_STAT_INC(hits);
+			return true;
+		}
+	}
+	CACHE_STAT_INC(misses);
+	return false;
+}
+
+UL_LINKAGE void _ul_cache_insert(const char *sym, size_t len, unsigned gen)
+{
+	assert(sym);
+	if (len > MAX_CACHE_SYM)
+		return;
+
+	struct entry *e = &cache[hash(sym, len)];
+	e->gen = gen;
+	e->len = len;
+	memcpy(e->sym, sym, len);
+	CACHE_STAT_INC(inserts);
+}
+
+UL_LINKAGE void _ul_cache_flush(unsigned gen)
+{
+	if (gen == 1)
+		ATOMIC_INC(epoch);
+	ATOMIC_INC(_ul_cache_flushes);
+}
+
+UL_LINKAGE void _ul_cache_memory(ul_memory_t *mem)
+{
+	mem->cache += sizeof(cache);
+}
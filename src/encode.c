@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "intern.h"
+#include "unitlib.h"
+
+/*
+ * Layout of an encoded unit:
+ *   header   version << 4 | flags
+ *   mask     bit i is set if exps[i] != 0
+ *   exps     zigzag varint for each exponent in mask
+ *   scale    zigzag varint, only with F_SCALE
+ *   factor   nothing with F_ONE, two little endian IEEE doubles (high and
+ *            low part) with F_DOUBLE2, one little endian IEEE double else
+ */
+
+enum {
+	ENC_VERSION = 1,
+
+	F_ONE     = 0x01, // factor is 1.0 and omitted
+	F_DOUBLE2 = 0x02, // factor does not fit into a double (long double builds)
+	F_SCALE   = 0x04, // a decimal exponent follows the exponents
+	F_MASK    = 0x07,
+};
+
+static_assert(NUM_BASE_UNITS <= 8); // the mask is one byte
+static_assert(UL_ENCODED_MAX >= 2 + (NUM_BASE_UNITS + 1) * 5 + 16);
+
+struct writer
+{
+	uint8_t *pos;
+};
+
+struct reader
+{
+	const uint8_t *pos;
+	const uint8_t *end;
+};
+
+static void put_varint(struct writer *w, int n)
+{
+	uint32_t z = ((uint32_t)n << 1) ^ (uint32_t)(n >> 31); // zigzag
+	while (z >= 0x80) {
+		*w->pos++ = (uint8_t)(z | 0x80);
+		z >>= 7;
+	}
+	*w->pos++ = (uint8_t)z;
+}
+
+static void put_double(struct writer *w, double d)
+{
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	for (int i=0; i < 8; ++i)
+		*w->pos++ = (uint8_t)(bits >> (8 * i));
+}
+
+static bool get_varint(struct reader *r, int *n)
+{
+	uint32_t z = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (r->pos >= r->end) {
+			ERROR(UL_ERR_ENCODING, "Truncated unit encoding");
+			return false;
+		}
+		uint8_t b = *r->pos++;
+		z |= (uint32_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			*n = (int)(z >> 1) ^ -(int)(z & 1);
+			return true;
+		}
+	}
+	ERROR(UL_ERR_ENCODING, "Invalid varint in unit encoding");
+	return false;
+}
+
+static bool get_double(struct reader *r, double *d)
+{
+	if (r->end - r->pos < 8) {
+		ERROR(UL_ERR_ENCODING, "Truncated unit encoding");
+		return false;
+	}
+	uint64_t bits = 0;
+	for (int i=0; i < 8; ++i)
+		bits |= (uint64_t)*r->pos++ << (8 * i);
+	memcpy(d, &bits, sizeof(bits));
+	return true;
+}
+
+UL_API size_t ul_encode(const unit_t *unit, void *buffer, size_t buflen)
+{
+	if (!unit || !buffer) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return 0;
+	}
+
+	// encode into a buffer that is always large enough, then copy
+	uint8_t tmp[UL_ENCODED_MAX];
+	struct writer w = { tmp + 2 };
+
+	uint8_t flags = 0;
+	uint8_t mask = 0;
+	for (int i=0; i < NUM_BASE_UNITS; ++i) {
+		if (unit->exps[i]) {
+			mask |= 1 << i;
+			put_varint(&w, unit->exps[i]);
+		}
+	}
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	if (unit->scale) {
+		flags |= F_SCALE;
+		put_varint(&w, unit->scale);
+	}
+#endif
+
+	double hi = (double)unit->factor;
+	if (unit->factor == 1.0) {
+		flags |= F_ONE;
+	}
+	else if ((ul_number)hi != unit->factor) {
+		flags |= F_DOUBLE2;
+		put_double(&w, hi);
+		put_double(&w, (double)(unit->factor - hi));
+	}
+	else {
+		put_double(&w, hi);
+	}
+
+	tmp[0] = (ENC_VERSION << 4) | flags;
+	tmp[1] = mask;
+
+	size_t len = w.pos - tmp;
+	if (len > buflen) {
+		ERROR(UL_ERR_PARAM, "Buffer too small, %zu bytes needed", len);
+		return 0;
+	}
+	memcpy(buffer, tmp, len);
+	return len;
+}
+
+UL_API size_t ul_decode(const void *buffer, size_t buflen, unit_t *unit)
+{
+	if (!buffer || !unit) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return 0;
+	}
+
+	struct reader r = { buffer, (const uint8_t *)buffer + buflen };
+	if (buflen < 2) {
+		ERROR(UL_ERR_ENCODING, "Truncated unit encoding");
+		return 0;
+	}
+	uint8_t header = *r.pos++;
+	uint8_t mask   = *r.pos++;
+
+	if ((header >> 4) != ENC_VERSION) {
+		ERROR(UL_ERR_ENCODING, "Unsupported unit encoding version %d", header >> 4);
+		return 0;
+	}
+	uint8_t flags = header & 0x0F;
+	if (flags & ~F_MASK) {
+		ERROR(UL_ERR_ENCODING, "Invalid flags in unit encoding: 0x%x", flags);
+		return 0;
+	}
+
+	unit_t u;
+	init_unit(&u);
+	for (int i=0; i < NUM_BASE_UNITS; ++i) {
+		if ((mask & (1 << i)) && !get_varint(&r, &u.exps[i]))
+			return 0;
+	}
+
+	int scale = 0;
+	if ((flags & F_SCALE) && !get_varint(&r, &scale))
+		return 0;
+
+	if (!(flags & F_ONE)) {
+		double hi, lo = 0.0;
+		if (!get_double(&r, &hi))
+			return 0;
+		if ((flags & F_DOUBLE2) && !get_double(&r, &lo))
+			return 0;
+		u.factor = (ul_number)hi + (ul_number)lo;
+	}
+	if (scale)
+		scale_unit(&u, scale);
+
+	copy_unit(&u, unit);
+	return r.pos - (const uint8_t *)buffer;
+}
+
+UL_API size_t ul_decode_all(const void *buffer, size_t buflen, unit_t *units, size_t max, size_t *used)
+{
+	if (!buffer || (!units && max)) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return 0;
+	}
+
+	const uint8_t *pos = buffer;
+	size_t left = buflen;
+	size_t n = 0;
+	while (n < max && left) {
+		size_t len = ul_decode(pos, left, &units[n]);
+		if (!len)
+			break;
+		pos  += len;
+		left -= len;
+		n++;
+	}
+	if (used)
+		*used = buflen - left;
+	return n;
+}
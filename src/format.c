@@ -12,6 +12,7 @@ struct status
 	const unit_t *unit;
 	ul_format_t  format;
 	void         *extra;
+	size_t       written; // characters put so far
 };
 
 enum result
@@ -78,7 +79,7 @@ static bool cnt_putc(char c, void *i)
 	return true;
 }
 
-#define _putc(s,c) (s)->put_char((c),(s)->info)
+#define _putc(s,c) ((s)->put_char((c),(s)->info) && ++(s)->written)
 
 #define CHECK(x) do { if (!(x)) return false; } while (0)
 
@@ -152,10 +153,11 @@ static enum result p_lfrac(struct printer *p, struct status *stat)
 		CHECK_R(_puts(stat, p->prefix));
 
 	bool first = true;
+	ul_number factor = unit_factor(stat->unit);
 
 	CHECK_R(_puts(stat, "\\frac{"));
-	if (_fabsn(stat->unit->factor) >= 1)
-		CHECK_R(p->fac(stat, stat->unit->factor, &first));
+	if (_fabsn(factor) >= 1)
+		CHECK_R(p->fac(stat, factor, &first));
 
 	for (int i=0; i < NUM_BASE_UNITS; ++i) {
 		if (stat->unit->exps[i] > 0)
@@ -166,8 +168,8 @@ static enum result p_lfrac(struct printer *p, struct status *stat)
 
 	CHECK_R(_puts(stat, "}{"));
 	first = true;
-	if (_fabsn(stat->unit->factor) < 1)
-		CHECK_R(p->fac(stat, stat->unit->factor, &first));
+	if (_fabsn(factor) < 1)
+		CHECK_R(p->fac(stat, factor, &first));
 	for (int i=0; i < NUM_BASE_UNITS; ++i) {
 		if (stat->unit->exps[i] < 0)
 			CHECK_R(p->sym(stat, _ul_symbols[i], -stat->unit->exps[i], &first));
@@ -255,7 +257,7 @@ static enum result def_normal(struct printer *p, struct status *stat)
 
 	bool first = true;
 
-	CHECK_R(p->fac(stat, stat->unit->factor, &first));
+	CHECK_R(p->fac(stat, unit_factor(stat->unit), &first));
 
 	for (int i=0; i < NUM_BASE_UNITS; ++i) {
 		if (stat->unit->exps[i] != 0)
@@ -268,17 +270,13 @@ static enum result def_normal(struct printer *p, struct status *stat)
 	return RES_OK;
 }
 
-static enum result def_reduce(struct printer *p, struct status *stat)
+static enum result print_reduced(struct printer *p, struct status *stat, const char *sym)
 {
-	const char *sym = _ul_reduce(stat->unit);
-	if (!sym)
-		return RES_FAIL;
-
 	if (p->prefix)
 		CHECK_R(_puts(stat, p->prefix));
 
 	bool first = true;
-	CHECK_R(p->fac(stat, stat->unit->factor, &first));
+	CHECK_R(p->fac(stat, unit_factor(stat->unit), &first));
 	CHECK_R(p->sym(stat, sym, 1, &first));
 
 	if (p->postfix)
@@ -287,6 +285,16 @@ static enum result def_reduce(struct printer *p, struct status *stat)
 	return RES_OK;
 }
 
+static enum result def_reduce(struct printer *p, struct status *stat)
+{
+	// sym belongs to the rule set, so keep that until it's printed
+	bool pinned = _ul_pin_rules();
+	const char *sym = _ul_reduce(stat->unit);
+	enum result res = sym ? print_reduced(p, stat, sym) : RES_FAIL;
+	_ul_unpin_rules(pinned);
+	return res;
+}
+
 static struct printer printer[UL_NUM_FORMATS] = {
 	[UL_FMT_PLAIN] = {
 		.sym = p_plain_sym,
@@ -317,7 +325,7 @@ static struct printer printer[UL_NUM_FORMATS] = {
 static bool _print(struct status *stat, int opts)
 {
 	if (stat->format >= UL_NUM_FORMATS) {
-		ERROR("Invalid format: %d\n", stat->format);
+		ERROR(UL_ERR_PARAM, "Invalid format: %d\n", stat->format);
 		return false;
 	}
 
@@ -331,6 +339,10 @@ static bool _print(struct status *stat, int opts)
 	enum result res = f(p, stat);
 	if (res == RES_FAIL)
 		res = p->normal(p, stat);
+
+	STAT_INC(format_calls);
+	STAT_ADD(format_bytes, stat->written);
+	TRACEPOINT3(print, stat->unit, stat->format, stat->written);
 	return res == RES_OK;
 }
 
@@ -348,7 +360,10 @@ UL_API bool ul_fprint(FILE *f, const unit_t *unit, ul_format_t format, int fops)
 		.extra  = NULL,
 	};
 
-	return _print(&status, fops);
+	LATENCY_BEGIN(start);
+	bool res = _print(&status, fops);
+	LATENCY_END(start, UL_LAT_PRINT);
+	return res;
 }
 
 UL_API bool ul_snprint(char *buffer, size_t buflen, const unit_t *unit, ul_format_t format, int fops)
@@ -369,7 +384,10 @@ UL_API bool ul_snprint(char *buffer, size_t buflen, const unit_t *unit, ul_forma
 
 	memset(buffer, 0, buflen);
 
-	return _print(&status, fops);
+	LATENCY_BEGIN(start);
+	bool res = _print(&status, fops);
+	LATENCY_END(start, UL_LAT_PRINT);
+	return res;
 }
 
 UL_API size_t ul_length(const unit_t *unit, ul_format_t format, int fops)
@@ -5,20 +5,116 @@
 #include <math.h>
 #include "unitlib.h"
 
+#define static_assert(e) extern char (*STATIC_ASSERT(void))[sizeof(char[1 - 2*!(e)])]
+
+#define sizeofarray(ar) (sizeof((ar))/sizeof((ar)[0]))
+
 extern const char *_ul_symbols[];
 extern size_t _ul_symlens[];
 
-extern bool _ul_debugging;
+// Each source file sets its category before including this header
+#ifndef DEBUG_CATEGORY
+#define DEBUG_CATEGORY UL_DBG_CORE
+#endif
+
+extern bool _ul_debugging; // any category enabled
+extern unsigned char _ul_debuglevels[UL_NUM_DBGCATS];
 UL_LINKAGE void _ul_debug(const char *fmt, ...);
-#define debug(fmt,...) \
+#ifdef UL_NO_DEBUG
+// still type checks the arguments, but no code is left
+#define DEBUG_AT(lvl,fmt,...) \
 	do { \
-		if (_ul_debugging) _ul_debug("[%s] " fmt "\n",\
-		                             __func__, ##__VA_ARGS__);\
+		if (0) _ul_debug(fmt, ##__VA_ARGS__); \
 	} while(0)
+#else
+#define DEBUG_AT(lvl,fmt,...) \
+	do { \
+		if (_ul_debuglevels[DEBUG_CATEGORY] >= (lvl)) \
+			_ul_debug("[%s] " fmt "\n", __func__, ##__VA_ARGS__);\
+	} while(0)
+#endif
+#define debug(fmt,...) DEBUG_AT(UL_DBG_INFO, fmt, ##__VA_ARGS__)
+#define trace(fmt,...) DEBUG_AT(UL_DBG_TRACE, fmt, ##__VA_ARGS__)
+
 
+// Static tracepoints, see UL_HAS_TRACEPOINTS. The names end up in the probes
+// as written (parse__begin), only DTrace turns "__" into "-"
+#ifdef UL_HAS_TRACEPOINTS
+#include <sys/sdt.h>
+#define TRACEPOINT1(name,a)     DTRACE_PROBE1(unitlib, name, a)
+#define TRACEPOINT2(name,a,b)   DTRACE_PROBE2(unitlib, name, a, b)
+#define TRACEPOINT3(name,a,b,c) DTRACE_PROBE3(unitlib, name, a, b, c)
+#else
+#define TRACEPOINT1(name,a)     do {} while (0)
+#define TRACEPOINT2(name,a,b)   do {} while (0)
+#define TRACEPOINT3(name,a,b,c) do {} while (0)
+#endif
 
-UL_LINKAGE void _ul_set_error(const char *func, int line, const char *fmt, ...);
-#define ERROR(msg, ...) _ul_set_error(__func__, __LINE__, msg, ##__VA_ARGS__)
+UL_LINKAGE void _ul_set_error(ul_errkind_t kind, const char *func, int line, const char *fmt, ...);
+#define ERROR(kind, msg, ...) _ul_set_error(kind, __func__, __LINE__, msg, ##__VA_ARGS__)
+
+UL_LINKAGE void _ul_set_error_quoted(ul_errkind_t kind, const char *func, int line, const char *msg, const char *str, size_t len, const char *after);
+#define ERROR_QUOTED(kind, msg, str, len, after) _ul_set_error_quoted(kind, __func__, __LINE__, msg, str, len, after)
+
+#if defined(__GNUC__)
+#define UL_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define UL_THREAD_LOCAL __declspec(thread)
+#else
+#define UL_THREAD_LOCAL // one set of counters shared by all threads
+#endif
+
+// The counters of the calling thread, see ul_stats and ul_cache_stats
+extern UL_THREAD_LOCAL ul_stats_t *_ul_local_stats;
+extern UL_THREAD_LOCAL ul_cache_stats_t *_ul_local_cache_stats;
+extern UL_THREAD_LOCAL unsigned _ul_local_stats_gen;
+extern unsigned _ul_stats_gen; // never 0
+UL_LINKAGE ul_stats_t *_ul_register_stats(void);
+UL_LINKAGE void _ul_release_stats(void); // before the calling thread ends
+UL_LINKAGE void _ul_free_stats(void);
+UL_LINKAGE void _ul_add_stats(const ul_stats_t *stats, const ul_cache_stats_t *cache); // to the calling thread
+
+static inline ul_stats_t *local_stats(void)
+{
+	if (_ul_local_stats_gen != _ul_stats_gen)
+		return _ul_register_stats();
+	return _ul_local_stats;
+}
+#define STAT_ADD(field, n) (local_stats()->field += (n))
+#define STAT_INC(field)    STAT_ADD(field, 1)
+
+static inline ul_cache_stats_t *local_cache_stats(void)
+{
+	if (_ul_local_stats_gen != _ul_stats_gen)
+		_ul_register_stats();
+	return _ul_local_cache_stats;
+}
+#define CACHE_STAT_INC(field) (local_cache_stats()->field++)
+
+// Where the calling thread announces the rule set it reads, NULL if the
+// thread has no block of its own
+extern UL_THREAD_LOCAL const void **_ul_local_pin;
+UL_LINKAGE bool _ul_rules_pinned(const void *set); // by any thread
+
+static inline const void **local_pin(void)
+{
+	if (_ul_local_stats_gen != _ul_stats_gen)
+		_ul_register_stats();
+	return _ul_local_pin;
+}
+extern unsigned long _ul_cache_flushes; // of all threads
+
+// Latency sampling, see ul_latency_sampling. Costs a single branch while
+// sampling is off.
+extern unsigned _ul_lat_every;
+UL_LINKAGE bool _ul_lat_sample(void);
+UL_LINKAGE uint64_t _ul_lat_now(void);
+UL_LINKAGE void _ul_lat_record(ul_latop_t op, uint64_t start);
+
+#define LATENCY_BEGIN(t) \
+	uint64_t t = (_ul_lat_every && _ul_lat_sample()) ? _ul_lat_now() : 0
+#define LATENCY_END(t, op) \
+	do { if (t) _ul_lat_record(op, t); } while (0)
 
 #define DBG_UNIT_HDR "  m  kg   s   A    K   M  Cd (L) - Factor"
 
@@ -28,23 +124,112 @@ UL_LINKAGE void _ul_set_error(const char *func, int line, const char *fmt, ...);
 #define DBG_UNIT_ARGS(u) \
 	(u)->exps[0], (u)->exps[1], (u)->exps[2], (u)->exps[3], (u)->exps[4], (u)->exps[5], (u)->exps[6], (u)->exps[7], (u)->factor
 
+// Makes the current rule set the one of the calling thread, _ul_reduce
+// needs one. Returns whether _ul_unpin_rules has to release it.
+UL_LINKAGE bool _ul_pin_rules(void);
+UL_LINKAGE void _ul_unpin_rules(bool pinned);
+
 UL_LINKAGE const char *_ul_reduce(const unit_t *unit);
 
+// All memory comes from here, see ul_set_allocator
+UL_LINKAGE void *_ul_malloc(size_t size);
+UL_LINKAGE void *_ul_calloc(size_t num, size_t size);
+UL_LINKAGE void *_ul_realloc(void *ptr, size_t size);
+UL_LINKAGE void _ul_free(void *ptr);
+UL_LINKAGE char *_ul_strdup(const char *str);
+extern bool _ul_initialized; // between ul_init and ul_quit
+
+// Add the memory of their module to mem, see ul_memory_usage
+UL_LINKAGE void _ul_rules_memory(ul_memory_t *mem);
+UL_LINKAGE void _ul_cache_memory(ul_memory_t *mem);
+UL_LINKAGE void _ul_units_memory(ul_memory_t *mem);
+UL_LINKAGE void _ul_stats_memory(ul_memory_t *mem);
+UL_LINKAGE void _ul_latency_memory(ul_memory_t *mem);
+
+UL_LINKAGE bool _ul_parse_number(const char *str, ul_number *n);
+UL_LINKAGE bool _ul_parse_decimal(const char *str, ul_number *mant, int *exp);
+UL_LINKAGE bool _ul_localize_number(const char *str, const char *point, char *buffer, size_t size);
+
+// Generation of the current rule set, changes with every change of its rules
+// and when another set becomes current, never 0
+extern unsigned _ul_rules_gen;
+
+UL_LINKAGE bool _ul_cache_lookup(const char *sym, size_t len, unsigned gen);
+UL_LINKAGE void _ul_cache_insert(const char *sym, size_t len, unsigned gen);
+UL_LINKAGE void _ul_cache_flush(unsigned gen);
+
+UL_LINKAGE void _ul_free_units(void);
+
 UL_LINKAGE bool _ul_init_parser(void);
 UL_LINKAGE void _ul_free_rules(void);
 
+// x^n by squaring, without calling into libm
+static inline ul_number ipow(ul_number x, int n)
+{
+	unsigned u = n < 0 ? -(unsigned)n : (unsigned)n;
+	ul_number res = 1.0;
+	while (u) {
+		if (u & 1)
+			res *= x;
+		x *= x;
+		u >>= 1;
+	}
+	return n < 0 ? 1 / res : res;
+}
+
+#define MAX_POW10 64
+extern const ul_number _ul_pow10_tab[];
+
+// 10^n, correctly rounded for |n| <= MAX_POW10
+static inline ul_number pow10i(int n)
+{
+	if (n < -MAX_POW10 || n > MAX_POW10)
+		return ipow(10.0, n);
+	return _ul_pow10_tab[n + MAX_POW10];
+}
+
 #define EXPS_SIZE(unit) (sizeof((unit)->exps[0]) * NUM_BASE_UNITS)
 
+#ifdef UL_HAS_DECIMAL_EXPONENT
+#define COPY_SCALE(dst, src) ((dst)->scale = (src)->scale)
+#else
+#define COPY_SCALE(dst, src) ((void)0)
+#endif
+
 static inline void init_unit(unit_t *unit)
 {
 	memset(unit->exps, 0, EXPS_SIZE(unit));
 	unit->factor = 1.0;
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	unit->scale = 0;
+#endif
 }
 
 static inline void copy_unit(const unit_t *restrict src, unit_t *restrict dst)
 {
 	memcpy(dst->exps, src->exps, EXPS_SIZE(dst));
 	dst->factor = src->factor;
+	COPY_SCALE(dst, src);
+}
+
+// Multiplies the factor of unit with 10^exp
+static inline void scale_unit(unit_t *unit, int exp)
+{
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	unit->scale += exp;
+#else
+	unit->factor *= pow10i(exp);
+#endif
+}
+
+// Returns the complete factor of a unit
+static inline ul_number unit_factor(const unit_t *unit)
+{
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	if (unit->scale)
+		return unit->factor * pow10i(unit->scale);
+#endif
+	return unit->factor;
 }
 
 static inline void add_unit(unit_t *restrict to, const unit_t *restrict other, int times)
@@ -52,7 +237,13 @@ static inline void add_unit(unit_t *restrict to, const unit_t *restrict other, i
 	for (int i=0; i < NUM_BASE_UNITS; ++i) {
 		to->exps[i] += (times * other->exps[i]);
 	}
-	to->factor *= _pown(other->factor, times);
+	if (times == 1)
+		to->factor *= other->factor;
+	else
+		to->factor *= ipow(other->factor, times);
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	to->scale += times * other->scale;
+#endif
 }
 
 static inline int ncmp(ul_number a, ul_number b)
@@ -64,4 +255,17 @@ static inline int ncmp(ul_number a, ul_number b)
 	return 1;
 }
 
+// Compares the factors of two units
+static inline int fcmp(const unit_t *a, const unit_t *b)
+{
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	// scale up the one with the larger exponent, so integer mantissas stay exact
+	if (a->scale > b->scale)
+		return ncmp(a->factor * pow10i(a->scale - b->scale), b->factor);
+	if (a->scale < b->scale)
+		return ncmp(a->factor, b->factor * pow10i(b->scale - a->scale));
+#endif
+	return ncmp(a->factor, b->factor);
+}
+
 #endif /*UL_INTERN_H*/
\ No newline at end of file
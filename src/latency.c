@@ -0,0 +1,211 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "intern.h"
+#include "unitlib.h"
+
+/*
+ * Log-linear (HDR style) buckets: values below SUB_COUNT ns get a bucket
+ * each, above that every power of two is split into SUB_COUNT buckets.
+ * So a bucket is never wider than 1/SUB_COUNT of its values.
+ */
+enum {
+	SUB_BITS    = 4,
+	SUB_COUNT   = 1 << SUB_BITS,
+	MAX_MSB     = 40, // ~18 minutes, longer operations are clamped
+	NUM_BUCKETS = (MAX_MSB - SUB_BITS + 2) * SUB_COUNT,
+};
+
+#ifdef __GNUC__
+#define ATOMIC_ADD(x, n) __sync_fetch_and_add(&(x), (n))
+#else
+#define ATOMIC_ADD(x, n) ((x) += (n))
+#endif
+
+struct histogram
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[NUM_BUCKETS];
+};
+
+static struct histogram histograms[UL_NUM_LATOPS];
+
+static const char *op_names[UL_NUM_LATOPS] = {
+	"parse", "parse_rule", "load_rules", "print",
+};
+
+unsigned _ul_lat_every = 0;
+static UL_THREAD_LOCAL unsigned countdown = 0;
+
+static inline int msb(uint64_t v)
+{
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(v);
+#else
+	int n = 0;
+	while (v >>= 1)
+		n++;
+	return n;
+#endif
+}
+
+static inline size_t bucket_index(uint64_t ns)
+{
+	if (ns < SUB_COUNT)
+		return ns;
+	int m = msb(ns);
+	if (m > MAX_MSB)
+		return NUM_BUCKETS - 1;
+	return (m - SUB_BITS + 1) * SUB_COUNT + ((ns >> (m - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// Smallest value of a bucket
+static inline uint64_t bucket_low(size_t idx)
+{
+	if (idx < SUB_COUNT)
+		return idx;
+	size_t m = idx / SUB_COUNT;
+	return (uint64_t)(SUB_COUNT + idx % SUB_COUNT) << (m - 1);
+}
+
+// Largest value of a bucket
+static inline uint64_t bucket_high(size_t idx)
+{
+	if (idx < SUB_COUNT)
+		return idx;
+	return bucket_low(idx) + ((uint64_t)1 << (idx / SUB_COUNT - 1)) - 1;
+}
+
+UL_LINKAGE bool _ul_lat_sample(void)
+{
+	if (countdown) {
+		countdown--;
+		return false;
+	}
+	countdown = _ul_lat_every - 1;
+	return true;
+}
+
+// Monotonic nanoseconds, never 0
+UL_LINKAGE uint64_t _ul_lat_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec + 1;
+#else
+	return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC) + 1;
+#endif
+}
+
+UL_LINKAGE void _ul_lat_record(ul_latop_t op, uint64_t start)
+{
+	uint64_t ns = _ul_lat_now() - start;
+	struct histogram *h = &histograms[op];
+	ATOMIC_ADD(h->buckets[bucket_index(ns)], 1);
+	ATOMIC_ADD(h->count, 1);
+	ATOMIC_ADD(h->sum, ns);
+}
+
+UL_LINKAGE void _ul_latency_memory(ul_memory_t *mem)
+{
+	mem->other += sizeof(histograms);
+}
+
+UL_API void ul_latency_sampling(unsigned every)
+{
+	_ul_lat_every = every;
+	countdown = 0;
+}
+
+UL_API void ul_latency_reset(void)
+{
+	memset(histograms, 0, sizeof(histograms));
+}
+
+UL_API bool ul_latency(ul_latop_t op, ul_latency_t *out)
+{
+	if (op >= UL_NUM_LATOPS || !out) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+	memset(out, 0, sizeof(*out));
+
+	// copy first, the histogram may change while we read it
+	struct histogram h = histograms[op];
+	uint64_t count = 0;
+	for (size_t i=0; i < NUM_BUCKETS; ++i)
+		count += h.buckets[i];
+	if (!count)
+		return true;
+
+	static const double ranks[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t *pcts[] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+
+	out->count = count;
+	out->mean  = h.sum / (h.count ? h.count : 1);
+
+	uint64_t seen = 0;
+	size_t r = 0;
+	for (size_t i=0; i < NUM_BUCKETS; ++i) {
+		if (!h.buckets[i])
+			continue;
+		if (!seen)
+			out->min = bucket_low(i);
+		seen += h.buckets[i];
+		for (; r < sizeofarray(ranks) && seen >= ranks[r] * count; ++r)
+			*pcts[r] = bucket_high(i);
+		out->max = bucket_high(i);
+	}
+	return true;
+}
+
+UL_API bool ul_latency_dump(FILE *f, bool json)
+{
+	if (!f) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+
+	if (json)
+		fprintf(f, "{");
+	for (int op=0; op < UL_NUM_LATOPS; ++op) {
+		ul_latency_t l;
+		ul_latency(op, &l);
+		if (!json) {
+			fprintf(f, "%-10s count %8llu  min %8llu  mean %8llu  p50 %8llu  p90 %8llu  "
+			           "p99 %8llu  p99.9 %8llu  max %8llu ns\n", op_names[op],
+			        (unsigned long long)l.count, (unsigned long long)l.min,
+			        (unsigned long long)l.mean, (unsigned long long)l.p50,
+			        (unsigned long long)l.p90, (unsigned long long)l.p99,
+			        (unsigned long long)l.p999, (unsigned long long)l.max);
+			continue;
+		}
+
+		fprintf(f, "%s\n  \"%s\": {\"count\": %llu, \"min\": %llu, \"mean\": %llu, "
+		           "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, "
+		           "\"max\": %llu, \"buckets\": [", op ? "," : "", op_names[op],
+		        (unsigned long long)l.count, (unsigned long long)l.min,
+		        (unsigned long long)l.mean, (unsigned long long)l.p50,
+		        (unsigned long long)l.p90, (unsigned long long)l.p99,
+		        (unsigned long long)l.p999, (unsigned long long)l.max);
+
+		// [lowest value, count] of all used buckets
+		bool first = true;
+		for (size_t i=0; i < NUM_BUCKETS; ++i) {
+			uint64_t n = histograms[op].buckets[i];
+			if (!n)
+				continue;
+			fprintf(f, "%s[%llu, %llu]", first ? "" : ", ",
+			        (unsigned long long)bucket_low(i), (unsigned long long)n);
+			first = false;
+		}
+		fprintf(f, "]}");
+	}
+	if (json)
+		fprintf(f, "\n}\n");
+	return !ferror(f);
+}
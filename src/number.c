@@ -0,0 +1,236 @@
+#include <assert.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_CATEGORY UL_DBG_NUMBER
+#include "intern.h"
+#include "unitlib.h"
+
+enum {
+	MAX_MANT_DIGITS = 19,  // Digits that always fit into the mantissa
+	MAX_EXACT_POW10 = 22,  // Largest power of ten that is exact in a double
+	MAX_NUMBER_SIZE = 128, // Longest number the slow path handles
+};
+
+// Largest integer that is exact in a double
+#define MAX_EXACT_MANT (UINT64_C(1) << 53)
+
+// The fast path needs exactly one rounding per operation, extended
+// precision evaluation of doubles (x87) would round twice
+#if defined(UL_HAS_LONG_DOUBLE) || (FLT_EVAL_METHOD == 0)
+#define HAS_FAST_PATH
+#endif
+
+#ifdef UL_HAS_LONG_DOUBLE
+#define NUM(x) x##L
+#else
+#define NUM(x) x
+#endif
+
+// Correctly rounded powers of ten, 10^0 to 10^22 are exact
+const ul_number _ul_pow10_tab[2 * MAX_POW10 + 1] = {
+	NUM(1e-64), NUM(1e-63), NUM(1e-62), NUM(1e-61), NUM(1e-60), NUM(1e-59),
+	NUM(1e-58), NUM(1e-57), NUM(1e-56), NUM(1e-55), NUM(1e-54), NUM(1e-53),
+	NUM(1e-52), NUM(1e-51), NUM(1e-50), NUM(1e-49), NUM(1e-48), NUM(1e-47),
+	NUM(1e-46), NUM(1e-45), NUM(1e-44), NUM(1e-43), NUM(1e-42), NUM(1e-41),
+	NUM(1e-40), NUM(1e-39), NUM(1e-38), NUM(1e-37), NUM(1e-36), NUM(1e-35),
+	NUM(1e-34), NUM(1e-33), NUM(1e-32), NUM(1e-31), NUM(1e-30), NUM(1e-29),
+	NUM(1e-28), NUM(1e-27), NUM(1e-26), NUM(1e-25), NUM(1e-24), NUM(1e-23),
+	NUM(1e-22), NUM(1e-21), NUM(1e-20), NUM(1e-19), NUM(1e-18), NUM(1e-17),
+	NUM(1e-16), NUM(1e-15), NUM(1e-14), NUM(1e-13), NUM(1e-12), NUM(1e-11),
+	NUM(1e-10), NUM(1e-9), NUM(1e-8), NUM(1e-7), NUM(1e-6), NUM(1e-5),
+	NUM(1e-4), NUM(1e-3), NUM(1e-2), NUM(1e-1), NUM(1e0), NUM(1e1),
+	NUM(1e2), NUM(1e3), NUM(1e4), NUM(1e5), NUM(1e6), NUM(1e7),
+	NUM(1e8), NUM(1e9), NUM(1e10), NUM(1e11), NUM(1e12), NUM(1e13),
+	NUM(1e14), NUM(1e15), NUM(1e16), NUM(1e17), NUM(1e18), NUM(1e19),
+	NUM(1e20), NUM(1e21), NUM(1e22), NUM(1e23), NUM(1e24), NUM(1e25),
+	NUM(1e26), NUM(1e27), NUM(1e28), NUM(1e29), NUM(1e30), NUM(1e31),
+	NUM(1e32), NUM(1e33), NUM(1e34), NUM(1e35), NUM(1e36), NUM(1e37),
+	NUM(1e38), NUM(1e39), NUM(1e40), NUM(1e41), NUM(1e42), NUM(1e43),
+	NUM(1e44), NUM(1e45), NUM(1e46), NUM(1e47), NUM(1e48), NUM(1e49),
+	NUM(1e50), NUM(1e51), NUM(1e52), NUM(1e53), NUM(1e54), NUM(1e55),
+	NUM(1e56), NUM(1e57), NUM(1e58), NUM(1e59), NUM(1e60), NUM(1e61),
+	NUM(1e62), NUM(1e63), NUM(1e64),
+};
+
+// A decimal number split into its parts
+struct decimal
+{
+	bool     neg;
+	uint64_t mant;  // the first MAX_MANT_DIGITS significant digits
+	int      exp;   // value is mant * 10^exp ...
+	bool     trunc; // ... unless digits were dropped from mant
+};
+
+// Splits a string in the form [+-]digits[.digits][(e|E)[+-]digits]
+static bool split_decimal(const char *str, struct decimal *dec)
+{
+	assert(str); assert(dec);
+	const char *p = str;
+
+	dec->neg   = false;
+	dec->mant  = 0;
+	dec->exp   = 0;
+	dec->trunc = false;
+
+	if (*p == '+' || *p == '-')
+		dec->neg = (*p++ == '-');
+
+	int ndigits = 0; // significant digits seen
+	bool any = false;
+	bool frac = false;
+	for (;; ++p) {
+		if (*p == '.' && !frac) {
+			frac = true;
+			continue;
+		}
+		if (*p < '0' || *p > '9')
+			break;
+		any = true;
+
+		if (ndigits < MAX_MANT_DIGITS) {
+			dec->mant = dec->mant * 10 + (*p - '0');
+			if (dec->mant)
+				ndigits++;
+			if (frac)
+				dec->exp--;
+		}
+		else {
+			if (*p != '0')
+				dec->trunc = true;
+			if (!frac)
+				dec->exp++;
+		}
+	}
+	if (!any)
+		return false;
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		bool eneg = false;
+		if (*p == '+' || *p == '-')
+			eneg = (*p++ == '-');
+		if (*p < '0' || *p > '9')
+			return false;
+
+		int e = 0;
+		for (; *p >= '0' && *p <= '9'; ++p) {
+			if (e < 100000) // way out of range anyway
+				e = e * 10 + (*p - '0');
+		}
+		dec->exp += eneg ? -e : e;
+	}
+	return *p == '\0';
+}
+
+#ifdef HAS_FAST_PATH
+// Clinger's fast path: exact mantissa and exact power of ten give a
+// correctly rounded result with a single operation
+static bool fast_decimal(const struct decimal *dec, ul_number *n)
+{
+	if (dec->trunc || dec->mant > MAX_EXACT_MANT)
+		return false;
+
+	uint64_t mant = dec->mant;
+	int exp = dec->exp;
+
+	if (mant == 0) {
+		exp = 0;
+	}
+	else if (exp > MAX_EXACT_POW10) {
+		// move some zeros into the mantissa, "12e25" = "12000e22"
+		while (exp > MAX_EXACT_POW10 && mant <= MAX_EXACT_MANT / 10) {
+			mant *= 10;
+			exp--;
+		}
+		if (exp > MAX_EXACT_POW10)
+			return false;
+	}
+	else if (exp < -MAX_EXACT_POW10) {
+		return false;
+	}
+
+	ul_number val = (ul_number)mant;
+	if (exp < 0)
+		val /= pow10i(-exp);
+	else
+		val *= pow10i(exp);
+
+	*n = dec->neg ? -val : val;
+	return true;
+}
+#endif
+
+// Copies the number str to buffer with point as the decimal point, false if
+// it does not fit
+UL_LINKAGE bool _ul_localize_number(const char *str, const char *point, char *buffer, size_t size)
+{
+	assert(str); assert(point); assert(buffer);
+
+	size_t plen = strlen(point);
+	size_t len = 0;
+	for (const char *p = str; *p; ++p) {
+		const char *src = p;
+		size_t slen = 1;
+		if (*p == '.') {
+			src = point;
+			slen = plen;
+		}
+		if (len + slen >= size)
+			return false;
+		memcpy(buffer + len, src, slen);
+		len += slen;
+	}
+	buffer[len] = '\0';
+	return true;
+}
+
+// Falls back to the C library, after translating the decimal point to the
+// one of the current locale
+static bool slow_decimal(const char *str, ul_number *n)
+{
+	char buffer[MAX_NUMBER_SIZE];
+	if (!_ul_localize_number(str, localeconv()->decimal_point, buffer, MAX_NUMBER_SIZE))
+		return false;
+
+	char *endptr = NULL;
+	*n = _strton(buffer, &endptr);
+	return endptr && !*endptr;
+}
+
+// Like _ul_parse_number, but the value is mant * 10^exp. If possible mant is
+// the exact integer mantissa, otherwise the whole value with exp = 0.
+UL_LINKAGE bool _ul_parse_decimal(const char *str, ul_number *mant, int *exp)
+{
+	assert(str); assert(mant); assert(exp);
+
+	struct decimal dec;
+	if (!split_decimal(str, &dec))
+		return false;
+
+	if (!dec.trunc && dec.mant <= MAX_EXACT_MANT) {
+		*mant = dec.neg ? -(ul_number)dec.mant : (ul_number)dec.mant;
+		*exp = dec.mant ? dec.exp : 0;
+		return true;
+	}
+	*exp = 0;
+	return _ul_parse_number(str, mant);
+}
+
+UL_LINKAGE bool _ul_parse_number(const char *str, ul_number *n)
+{
+	assert(str); assert(n);
+
+	struct decimal dec;
+	if (!split_decimal(str, &dec))
+		return false;
+
+#ifdef HAS_FAST_PATH
+	if (fast_decimal(&dec, n))
+		return true;
+#endif
+	trace("Slow path for '%s'", str);
+	return slow_decimal(str, n);
+}
@@ -1,42 +1,290 @@
+#define _POSIX_C_SOURCE 200112L
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#define DEBUG_CATEGORY UL_DBG_PARSER
 #include "intern.h"
 #include "unitlib.h"
 
-// My string.h is missing strdup so place it here.
-char *strdup(const char *s1);
+#if defined(__unix__) || defined(__APPLE__)
+#define HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(HAS_MMAP) && !defined(UL_NO_THREADS)
+#define HAS_THREADS
+#include <pthread.h>
+#endif
+
+
+enum {
+	SYM_INLINE = 16, // Shorter symbols are stored in the rule itself
+};
+
+// Flags of a rule
+enum {
+	RULE_FORCE  = 0x01, // cannot be redefined
+	RULE_DEAD   = 0x02, // removed, the slot stays so indices remain valid
+	RULE_POOLED = 0x04, // the symbol is in the string pool
+};
 
-// A unit conversion rule
+// A unit conversion rule, kept small so scans over all rules are cheap
 typedef struct rule
 {
-	const char *symbol;
-	unit_t unit;
-	bool   force;
-	struct rule *next;
+	ul_number factor;
+	int16_t   exps[NUM_BASE_UNITS];
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	int32_t   scale;
+#endif
+	union {
+		char     inline_sym[SYM_INLINE]; // NUL terminated
+		uint32_t pool_offset;
+	} sym;
+	uint8_t   flags;
 } rule_t;
 
-// A unit prefix (like mili)
-typedef struct prefix
+#ifdef UL_HAS_DECIMAL_EXPONENT
+#define RULE_SCALE(s) .scale = (s),
+#define GRAM_FACTOR   1
+#else
+#define RULE_SCALE(s)
+#define GRAM_FACTOR   ((ul_number)1 / 1000)
+#endif
+
+#define BASE_RULE(symbol, unit) \
+	{ .factor = 1, .exps = { [unit] = 1 }, .sym.inline_sym = symbol, .flags = RULE_FORCE }
+
+// The rules every rule set starts with, in the order of _ul_symbols
+static const rule_t static_rules[] = {
+	BASE_RULE("m",   U_METER),
+	BASE_RULE("kg",  U_KILOGRAM),
+	BASE_RULE("s",   U_SECOND),
+	BASE_RULE("A",   U_AMPERE),
+	BASE_RULE("K",   U_KELVIN),
+	BASE_RULE("mol", U_MOL),
+	BASE_RULE("Cd",  U_CANDELA),
+	BASE_RULE("L",   U_LEMMING),
+	// stupid inconsistend SI system...
+	{ .factor = GRAM_FACTOR, .exps = { [U_KILOGRAM] = 1 }, RULE_SCALE(-3)
+	  .sym.inline_sym = "g", .flags = RULE_FORCE },
+};
+
+enum {
+	NUM_STATIC_RULES = sizeofarray(static_rules),
+};
+
+// The exponents of the SI prefixes (10^exp) by their character, 0 if it is none
+static const signed char prefixes[UCHAR_MAX+1] = {
+	['Y'] =  24, // yotta
+	['Z'] =  21, // zetta
+	['E'] =  18, // exa
+	['P'] =  15, // peta
+	['T'] =  12, // tera
+	['G'] =   9, // giga
+	['M'] =   6, // mega
+	['k'] =   3, // kilo
+	['h'] =   2, // hecto
+	// missing: da - deca
+	['d'] =  -1, // deci
+	['c'] =  -2, // centi
+	['m'] =  -3, // milli
+	['u'] =  -6, // micro
+	['n'] =  -9, // nano
+	['p'] = -12, // pico
+	['f'] = -15, // femto
+	['a'] = -18, // atto
+	['z'] = -21, // zepto
+	['y'] = -24, // yocto
+};
+
+// A node of the symbol trie. The children of a node are found through the
+// edge table (see trie_child), so every level costs the same.
+typedef struct trie_node
+{
+	char     c;      // last character of the symbol up to this node
+	uint32_t parent; // index into trie[] or NO_NODE for the root
+	uint32_t rule;   // index of the rule with this symbol or NO_RULE
+} trie_node_t;
+
+// trie[0] is never used, so 0 can mark missing links and empty edges
+#define NO_NODE   0
+#define TRIE_ROOT 1
+
+#define NO_RULE UINT32_MAX
+
+// Where a rule after static_rules came from, to recompute it when a rule it
+// uses is redefined
+typedef struct rule_src
+{
+	uint32_t def;        // offset of the definition in the pool
+	uint32_t first_dep;  // the rules the definition uses are in deps[]
+	uint32_t num_deps;
+	uint32_t first_user; // the rules using this one, a list in uses[]
+	uint32_t same_next;  // the living rules with the same exponents form a
+	uint32_t same_prev;  // ring in order of their indices, see index_insert
+	uint32_t mark;       // see find_users
+	uint32_t pending;
+} rule_src_t;
+
+// An entry of the list of the rules that use a rule. Entries of dead users
+// stay until compact_deps.
+typedef struct rule_use
+{
+	uint32_t user; // index of the rule
+	uint32_t next; // the next entry or NO_USE
+} rule_use_t;
+
+// uses[0] is never used, so 0 can mark the end of a list
+#define NO_USE 0
+
+// Enough trie nodes for the static rules and a few more
+enum {
+	TRIE_STATIC = 64,
+	MIN_SLOTS   = 64, // Initial size of the exponent index
+};
+
+// All rules and their symbol index, a ul_ruleset_t
+struct ul_ruleset
+{
+	unsigned refs; // the set is freed when the last reference is gone
+	unsigned gen;  // changes with every change of the rules, unique over all sets
+	unsigned pins; // readers without a block of their own, see pin_current
+	struct ul_ruleset *next_retired; // see release_set
+
+	// the rules after static_rules, in order of definition
+	rule_t   *rules;
+	uint32_t num_rules; // including the static rules
+	uint32_t rules_cap;
+
+	// symbols of SYM_INLINE or more characters and the definitions
+	char     *pool;
+	uint32_t pool_size;
+	uint32_t pool_cap;
+
+	// parallel to rules, NULL for attached rules
+	rule_src_t *srcs;
+	uint32_t   *deps;      // the rules of each definition, in order of use
+	uint32_t   deps_size;
+	uint32_t   deps_cap;
+	uint32_t   deps_dead;  // entries no rule refers to anymore
+	rule_use_t *uses;
+	uint32_t   uses_size;
+	uint32_t   uses_cap;
+	bool       uses_lost;  // an entry didn't fit, see add_use
+	uint32_t   last_mark;  // see find_users
+
+	// the trie over all symbols, updated by add_rule and rm_rule
+	trie_node_t *trie;
+	uint32_t    trie_size;
+	uint32_t    trie_cap;
+
+	// every node but the root by parent and character, open addressing
+	// with node indices, kept below a load factor of 1/2
+	uint32_t *edges;
+	uint32_t num_edges;
+
+	// the first living rule after static_rules for every exponent vector,
+	// open addressing with rule index + 1, 0 marks empty slots
+	uint32_t *slots;
+	uint32_t num_slots;  // 0 if there is no index, see index_rebuild
+	uint32_t slots_used;
+
+	// set by ul_attach_rules, all of the above point into it then
+	const void *map;
+	size_t     map_size;
+};
+
+// The set that is current after ul_init, it's never freed
+static struct ul_ruleset main_set;
+
+// Until they grow, the trie of main_set and its edges live here, so ul_init
+// needs no allocation
+static trie_node_t trie_buf[TRIE_STATIC];
+static uint32_t    edges_buf[2 * TRIE_STATIC];
+
+// The set ul_parse and friends use. Readers announce the set they read in
+// the block of their thread (see pin_current), so reading takes no lock.
+// Changing current, the slow pins and the retired sets take current_lock.
+static struct ul_ruleset *current = &main_set;
+static volatile int current_lock = 0;
+
+// Sets without references that some thread still reads, see release_set
+static struct ul_ruleset *retired = NULL;
+
+// The set changed in place by ul_parse_rule and friends, see begin_write
+static struct ul_ruleset *writing = NULL;
+
+#ifdef HAS_THREADS
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER; // one writer at a time
+static pthread_mutex_t wait_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wait_cond  = PTHREAD_COND_INITIALIZER;  // writing or a pin changed
+#endif
+
+// The set the calling thread works with, see pin_current
+static UL_THREAD_LOCAL struct ul_ruleset *rs = NULL;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_PAUSE() __builtin_ia32_pause()
+#else
+#define CPU_PAUSE() ((void)0)
+#endif
+
+#ifdef __GNUC__
+#define ATOMIC_INC(x) __sync_add_and_fetch(&(x), 1)
+#define ATOMIC_DEC(x) __sync_sub_and_fetch(&(x), 1)
+#define LOCK(l) \
+	while (__sync_lock_test_and_set(&(l), 1)) \
+		while (__atomic_load_n(&(l), __ATOMIC_RELAXED)) \
+			CPU_PAUSE()
+#define UNLOCK(l)     __sync_lock_release(&(l))
+#define LOAD_ACQUIRE(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define LOAD_SEQ(x)         __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE_SEQ(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#else
+#define ATOMIC_INC(x) (++(x))
+#define ATOMIC_DEC(x) (--(x))
+#define LOCK(l)       ((void)0)
+#define UNLOCK(l)     ((void)0)
+#define LOAD_ACQUIRE(x)     (x)
+#define STORE_RELEASE(x, v) ((x) = (v))
+#define LOAD_SEQ(x)         (x)
+#define STORE_SEQ(x, v)     ((x) = (v))
+#endif
+
+// Returns the rule with index idx
+static inline const rule_t *rule_at(uint32_t idx)
 {
-	char symbol;
-	ul_number value;
-	struct prefix *next;
-} prefix_t;
+	if (idx < NUM_STATIC_RULES)
+		return &static_rules[idx];
+	return &rs->rules[idx - NUM_STATIC_RULES];
+}
 
-// A list of all rules
-static rule_t *rules = NULL;
-// The base rules
-static rule_t base_rules[NUM_BASE_UNITS];
-// A list of all prefixes
-static prefix_t *prefixes = NULL;
+static inline const char *rule_symbol(const rule_t *rule)
+{
+	if (rule->flags & RULE_POOLED)
+		return rs->pool + rule->sym.pool_offset;
+	return rule->sym.inline_sym;
+}
 
-// Symbolic definition for the first dynamic allocated rule
-// valid after _ul_init_parser() ist called
-#define dynamic_rules (base_rules[NUM_BASE_UNITS-1].next)
+static inline void rule_unit(const rule_t *rule, unit_t *unit)
+{
+	for (int i=0; i < NUM_BASE_UNITS; ++i)
+		unit->exps[i] = rule->exps[i];
+	unit->factor = rule->factor;
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	unit->scale = rule->scale;
+#endif
+}
 
 enum {
 	STACK_SIZE = 16,     // Size of the parser state stack
@@ -52,6 +300,20 @@ struct substate
 	int    sign;
 };
 
+// The rules a definition uses, in order of their symbols, without the static
+// rules used without a prefix
+struct deplist
+{
+	uint32_t *idx;
+	uint32_t num;
+	uint32_t cap;
+	uint32_t replay;     // while replay < replay_end, the rules are taken
+	uint32_t replay_end; // from idx instead of being looked up
+
+	struct loader *loader; // set while load_worker parses rule
+	uint32_t      rule;
+};
+
 // The state of an ongoing parse
 struct parser_state
 {
@@ -62,6 +324,8 @@ struct parser_state
 	bool brkt;  // true if the next item has to be an opening bracket
 	char wasop; // true if the last item was an operator ('*' or '/')
 	bool nextsqrt; // true if the next substate is in sqrt
+
+	struct deplist *deps; // gets the rules used, may be NULL
 };
 #define CURRENT(what,state) (state)->stack[(state)->spos].what
 
@@ -83,92 +347,552 @@ enum result {
 		assert(macro_rs == RS_NOT_MINE); \
 	} while (0);
 
-// Returns the last rule in the list
-static rule_t *last_rule(void)
+unsigned _ul_rules_gen = 1;
+
+static unsigned last_gen = 1;
+
+// Has to be called after every change of the rules
+static void rules_changed(void)
 {
-	rule_t *cur = rules;
-	while (cur) {
-		if (!cur->next)
-			return cur;
-		cur = cur->next;
+	unsigned gen = ATOMIC_INC(last_gen);
+	if (!gen)
+		gen = ATOMIC_INC(last_gen);
+	rs->gen = gen;
+	if (rs == LOAD_ACQUIRE(current))
+		_ul_rules_gen = gen;
+	_ul_cache_flush(gen);
+}
+
+static inline uint32_t hash_edge(uint32_t parent, char c)
+{
+	uint32_t h = (parent * 257 + (unsigned char)c) * 2654435761u;
+	return h ^ (h >> 16);
+}
+
+// Returns the child of node for character c
+static inline uint32_t trie_child(uint32_t node, char c)
+{
+	uint32_t mask = rs->num_edges - 1;
+	for (uint32_t i = hash_edge(node, c) & mask; rs->edges[i]; i = (i + 1) & mask) {
+		const trie_node_t *child = &rs->trie[rs->edges[i]];
+		if (child->parent == node && child->c == c)
+			return rs->edges[i];
 	}
-	// rules cannot be NULL
-	assert(false);
-	return NULL;
+	return NO_NODE;
+}
+
+static void edge_insert(uint32_t node)
+{
+	uint32_t mask = rs->num_edges - 1;
+	uint32_t i = hash_edge(rs->trie[node].parent, rs->trie[node].c) & mask;
+	while (rs->edges[i])
+		i = (i + 1) & mask;
+	rs->edges[i] = node;
+}
+
+static void edge_remove(uint32_t node)
+{
+	uint32_t mask = rs->num_edges - 1;
+	uint32_t i = hash_edge(rs->trie[node].parent, rs->trie[node].c) & mask;
+	while (rs->edges[i] && rs->edges[i] != node)
+		i = (i + 1) & mask;
+	if (!rs->edges[i])
+		return;
+
+	// the edges after it move back where they can
+	for (uint32_t j = (i + 1) & mask; rs->edges[j]; j = (j + 1) & mask) {
+		const trie_node_t *cur = &rs->trie[rs->edges[j]];
+		uint32_t home = hash_edge(cur->parent, cur->c) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			rs->edges[i] = rs->edges[j];
+			i = j;
+		}
+	}
+	rs->edges[i] = 0;
+}
+
+// Doubles the edge table and enters the edges of all nodes again
+static bool edges_grow(void)
+{
+	uint32_t num = rs->num_edges ? 2 * rs->num_edges : 2 * TRIE_STATIC;
+	uint32_t *edges = _ul_malloc(num * sizeof(uint32_t));
+	if (!edges) {
+		ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+		return false;
+	}
+	memset(edges, 0, num * sizeof(uint32_t));
+	if (rs->edges != edges_buf)
+		_ul_free(rs->edges);
+	rs->edges = edges;
+	rs->num_edges = num;
+	for (uint32_t i = TRIE_ROOT + 1; i < rs->trie_size; ++i)
+		edge_insert(i);
+	return true;
+}
+
+// Adds a node below parent, or the root with NO_NODE
+static uint32_t trie_new_node(uint32_t parent, char c)
+{
+	if (2 * (rs->trie_size + 1) > rs->num_edges && !edges_grow())
+		return NO_NODE;
+	if (rs->trie_size >= rs->trie_cap) {
+		uint32_t cap = rs->trie_cap ? rs->trie_cap + rs->trie_cap / 2 : TRIE_STATIC;
+		trie_node_t *t = _ul_realloc(rs->trie == trie_buf ? NULL : rs->trie, cap * sizeof(*t));
+		if (!t) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return NO_NODE;
+		}
+		if (rs->trie == trie_buf)
+			memcpy(t, trie_buf, sizeof(trie_buf));
+		rs->trie = t;
+		rs->trie_cap = cap;
+	}
+	trie_node_t *node = &rs->trie[rs->trie_size];
+	memset(node, 0, sizeof(*node)); // no garbage in ul_publish_rules
+	node->c = c;
+	node->parent = parent;
+	node->rule = NO_RULE;
+	if (parent != NO_NODE)
+		edge_insert(rs->trie_size);
+	return rs->trie_size++;
+}
+
+// Empties the trie, leaving only the root
+static bool trie_init(void)
+{
+	if (!rs->trie && rs == &main_set) {
+		rs->trie = trie_buf;
+		rs->trie_cap = TRIE_STATIC;
+	}
+	if (!rs->edges && rs == &main_set) {
+		rs->edges = edges_buf;
+		rs->num_edges = 2 * TRIE_STATIC;
+	}
+	if (rs->edges)
+		memset(rs->edges, 0, rs->num_edges * sizeof(uint32_t));
+	rs->trie_size = TRIE_ROOT;
+	if (trie_new_node(NO_NODE, '\0') != TRIE_ROOT)
+		return false;
+	memset(&rs->trie[0], 0, sizeof(rs->trie[0])); // unused, but published
+	return true;
 }
 
-// Returns the rule to a symbol
-static rule_t *get_rule(const char *sym)
+// Returns the node for sym, with create new nodes are added as needed
+static uint32_t trie_find(const char *sym, bool create)
 {
 	assert(sym);
-	for (rule_t *cur = rules; cur; cur = cur->next) {
-		if (strcmp(cur->symbol, sym) == 0)
-			return cur;
+	uint32_t node = TRIE_ROOT;
+	for (; *sym; ++sym) {
+		uint32_t next = trie_child(node, *sym);
+		if (next == NO_NODE) {
+			if (!create)
+				return NO_NODE;
+			next = trie_new_node(node, *sym);
+			if (next == NO_NODE)
+				return NO_NODE;
+		}
+		node = next;
 	}
-	return NULL;
+	return node;
 }
 
-// Returns the last prefix in the list
-static prefix_t *last_prefix(void)
+// False if out of memory or, without an error, if the symbol is taken
+static bool trie_insert(uint32_t rule)
 {
-	prefix_t *cur = prefixes;
-	while (cur) {
-		if (!cur->next)
-			return cur;
-		cur = cur->next;
+	uint32_t node = trie_find(rule_symbol(rule_at(rule)), true);
+	if (node == NO_NODE || rs->trie[node].rule != NO_RULE)
+		return false;
+	rs->trie[node].rule = rule;
+	return true;
+}
+
+static void trie_remove(uint32_t rule)
+{
+	uint32_t node = trie_find(rule_symbol(rule_at(rule)), false);
+	if (node != NO_NODE && rs->trie[node].rule == rule)
+		rs->trie[node].rule = NO_RULE;
+}
+
+// Drops the nodes from size on
+static void trie_truncate(uint32_t size)
+{
+	for (uint32_t i = rs->trie_size; i > size; --i)
+		edge_remove(i - 1);
+	rs->trie_size = size;
+}
+
+// Returns the index of the rule to a symbol or NO_RULE
+static uint32_t get_rule(const char *sym)
+{
+	uint32_t node = trie_find(sym, false);
+	return node != NO_NODE ? rs->trie[node].rule : NO_RULE;
+}
+
+// Gives back the storage of the rules or detaches attached ones, the rule
+// set is empty afterwards
+static void release_rules(void)
+{
+	if (rs->map) {
+#ifdef HAS_MMAP
+		munmap((void*)rs->map, rs->map_size);
+#endif
 	}
-	return NULL;
+	else {
+		if (rs->trie != trie_buf)
+			_ul_free(rs->trie);
+		if (rs->edges != edges_buf)
+			_ul_free(rs->edges);
+		_ul_free(rs->rules);
+		_ul_free(rs->pool);
+		_ul_free(rs->srcs);
+		_ul_free(rs->deps);
+		_ul_free(rs->uses);
+		_ul_free(rs->slots);
+	}
+	unsigned refs = rs->refs, gen = rs->gen;
+	memset(rs, 0, sizeof(*rs));
+	rs->refs = refs;
+	rs->gen  = gen;
 }
 
-// Returns the prefix definition to a character
-static prefix_t *get_prefix(char sym)
+// Returns an empty set with one reference
+static struct ul_ruleset *new_set(void)
 {
-	for (prefix_t *cur = prefixes; cur; cur = cur->next) {
-		if (cur->symbol == sym)
-			return cur;
+	struct ul_ruleset *set = _ul_calloc(1, sizeof(*set));
+	if (!set) {
+		ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+		return NULL;
 	}
-	return NULL;
+	set->refs = 1;
+	return set;
 }
 
-// Skips all spaces at the beginning of the string
-static size_t skipspace(const char *text, size_t start)
+// Returns a new reference to the current set
+static struct ul_ruleset *acquire_current(void)
+{
+	LOCK(current_lock);
+	struct ul_ruleset *set = current;
+	ATOMIC_INC(set->refs);
+	UNLOCK(current_lock);
+	return set;
+}
+
+// Wakes the threads waiting in wait_writer and wait_readers
+static void wake_waiters(void)
+{
+#ifdef HAS_THREADS
+	pthread_mutex_lock(&wait_lock);
+	pthread_cond_broadcast(&wait_cond);
+	pthread_mutex_unlock(&wait_lock);
+#endif
+}
+
+// Waits until set is not written anymore
+static void wait_writer(const struct ul_ruleset *set)
+{
+#ifdef HAS_THREADS
+	pthread_mutex_lock(&wait_lock);
+	pthread_cond_broadcast(&wait_cond); // the writer may wait for us
+	while (LOAD_SEQ(writing) == set)
+		pthread_cond_wait(&wait_cond, &wait_lock);
+	pthread_mutex_unlock(&wait_lock);
+#else
+	while (LOAD_SEQ(writing) == set)
+		CPU_PAUSE();
+#endif
+}
+
+// Frees the retired sets no thread reads anymore, with all every one
+static void reclaim(bool all)
+{
+	struct ul_ruleset *dead = NULL;
+	LOCK(current_lock);
+	struct ul_ruleset **link = &retired;
+	while (*link) {
+		struct ul_ruleset *set = *link;
+		if (!all && _ul_rules_pinned(set)) {
+			link = &set->next_retired;
+			continue;
+		}
+		STORE_SEQ(*link, set->next_retired); // link may be retired
+		set->next_retired = dead;
+		dead = set;
+	}
+	UNLOCK(current_lock);
+
+	struct ul_ruleset *saved = rs;
+	while (dead) {
+		struct ul_ruleset *next = dead->next_retired;
+		rs = dead;
+		release_rules();
+		if (dead != &main_set)
+			_ul_free(dead);
+		dead = next;
+	}
+	rs = saved;
+}
+
+// Drops a reference to set. Threads may still read a set without
+// references (see pin_current), so it's retired first and freed by the
+// last of them.
+static void release_set(struct ul_ruleset *set)
+{
+	if (ATOMIC_DEC(set->refs) != 0)
+		return;
+	LOCK(current_lock);
+	set->next_retired = retired;
+	STORE_SEQ(retired, set);
+	UNLOCK(current_lock);
+	reclaim(false);
+}
+
+// Makes the current set the one of the calling thread, unless the thread has
+// one already. Returns whether unpin_current has to be called.
+//
+// The thread announces the set in its block and then checks that it's still
+// current, a thread that replaces current checks the blocks after it did.
+// So either the reader tries again or the set outlives the read. The same
+// goes for writing, see begin_write.
+static inline bool pin_current(void)
+{
+	if (rs)
+		return false;
+	const void **pin = local_pin();
+	if (!pin) {
+		// no block, the set gets a reference instead
+		for (;;) {
+			LOCK(current_lock);
+			struct ul_ruleset *set = current;
+			if (LOAD_SEQ(writing) != set) {
+				ATOMIC_INC(set->refs);
+				ATOMIC_INC(set->pins);
+				UNLOCK(current_lock);
+				rs = set;
+				return true;
+			}
+			UNLOCK(current_lock);
+			wait_writer(set);
+		}
+	}
+	for (;;) {
+		struct ul_ruleset *set = LOAD_SEQ(current);
+		STORE_SEQ(*pin, set);
+		if (LOAD_SEQ(current) != set)
+			continue;
+		if (LOAD_SEQ(writing) != set) {
+			rs = set;
+			return true;
+		}
+		STORE_SEQ(*pin, NULL);
+		wait_writer(set);
+	}
+}
+
+static inline void unpin_current(bool pinned)
+{
+	if (!pinned)
+		return;
+	struct ul_ruleset *set = rs;
+	rs = NULL;
+	const void **pin = local_pin();
+	if (pin && *pin == set) {
+		STORE_SEQ(*pin, NULL);
+		if (LOAD_SEQ(writing))
+			wake_waiters();
+		if (LOAD_SEQ(retired))
+			reclaim(false);
+		return;
+	}
+	ATOMIC_DEC(set->pins);
+	if (LOAD_SEQ(writing))
+		wake_waiters();
+	release_set(set);
+}
+
+// Makes set the one of the calling thread for a change in place, with set
+// NULL the current one. Threads that read set finish first, new ones wait
+// until end_write.
+static struct ul_ruleset *begin_write(struct ul_ruleset *set)
+{
+#ifdef HAS_THREADS
+	pthread_mutex_lock(&write_lock);
+#endif
+	LOCK(current_lock);
+	if (!set)
+		set = current;
+	ATOMIC_INC(set->refs);
+	STORE_SEQ(writing, set);
+	UNLOCK(current_lock);
+
+#ifdef HAS_THREADS
+	pthread_mutex_lock(&wait_lock);
+	while (_ul_rules_pinned(set) || LOAD_SEQ(set->pins))
+		pthread_cond_wait(&wait_cond, &wait_lock);
+	pthread_mutex_unlock(&wait_lock);
+#else
+	while (_ul_rules_pinned(set) || LOAD_SEQ(set->pins))
+		CPU_PAUSE();
+#endif
+	struct ul_ruleset *saved = rs;
+	rs = set;
+	return saved;
+}
+
+static void end_write(struct ul_ruleset *saved)
+{
+	struct ul_ruleset *set = rs;
+	rs = saved;
+	STORE_SEQ(writing, NULL);
+	wake_waiters();
+#ifdef HAS_THREADS
+	pthread_mutex_unlock(&write_lock);
+#endif
+	release_set(set);
+}
+
+// Returns the exponent of the prefix c, 0 if c is none
+static inline int get_prefix(char c)
+{
+	return prefixes[(unsigned char)c];
+}
+
+// Character classes for the tokenizer
+enum {
+	CH_SPACE = 0x01, // like isspace() in the "C" locale
+	CH_SPLIT = 0x02, // splits items even without a space
+};
+
+static const unsigned char charclasses[256] = {
+	[' ']  = CH_SPACE,
+	['\t'] = CH_SPACE,
+	['\n'] = CH_SPACE,
+	['\v'] = CH_SPACE,
+	['\f'] = CH_SPACE,
+	['\r'] = CH_SPACE,
+	['*'] = CH_SPLIT,
+	['/'] = CH_SPLIT,
+	['('] = CH_SPLIT,
+	[')'] = CH_SPLIT,
+};
+static inline bool isspc(char c)
+{
+	return charclasses[(unsigned char)c] & CH_SPACE;
+}
+
+// What scan() is looking for
+enum scan {
+	SCAN_NONSPACE,    // the first character that is not a space
+	SCAN_SPACE,       // the first space
+	SCAN_SPACE_SPLIT, // the first space or split character
+};
+
+#if defined(__SSE2__) && !defined(UL_NO_SIMD)
+#include <emmintrin.h>
+
+// Bitmask of the characters in the block that match what we scan for
+static inline unsigned scan_mask(__m128i v, enum scan what)
+{
+	// spaces are ' ' and '\t' to '\r'
+	__m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i space = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8('\r' - '\t')), ctl);
+	space = _mm_or_si128(space, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+
+	if (what == SCAN_NONSPACE)
+		return ~_mm_movemask_epi8(space) & 0xFFFF;
+
+	__m128i stop = _mm_or_si128(space, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	if (what == SCAN_SPACE_SPLIT) {
+		stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+		stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+		stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+		stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+	}
+	return _mm_movemask_epi8(stop);
+}
+
+// Scans 16 characters at a time. Only aligned blocks are loaded, they never
+// cross a page boundary, so reading beyond the terminating '\0' is harmless.
+static size_t scan(const char *text, size_t start, enum scan what)
 {
 	assert(text);
-	size_t i = start;
-	while (text[i] && isspace(text[i]))
-		i++;
-	return i;
+	const char *p = text + start;
+	size_t misalign = (size_t)((uintptr_t)p & 15);
+	const __m128i *block = (const __m128i *)(p - misalign);
+
+	unsigned mask = scan_mask(_mm_load_si128(block), what) & (0xFFFFu << misalign);
+	while (!mask) {
+		block++;
+		mask = scan_mask(_mm_load_si128(block), what);
+	}
+	return (size_t)((const char *)block - text) + __builtin_ctz(mask);
 }
 
-// Returns the position of the next space in the string
-static size_t nextspace(const char *text, size_t start)
+#else
+
+static size_t scan(const char *text, size_t start, enum scan what)
 {
 	assert(text);
 	size_t i = start;
-	while (text[i] && !isspace(text[i]))
-		i++;
+	switch (what) {
+	case SCAN_NONSPACE:
+		while (isspc(text[i]))
+			i++;
+		break;
+	case SCAN_SPACE:
+		while (text[i] && !isspc(text[i]))
+			i++;
+		break;
+	case SCAN_SPACE_SPLIT:
+		while (text[i] && !charclasses[(unsigned char)text[i]])
+			i++;
+		break;
+	}
 	return i;
 }
 
-static bool splitchars[256] = {
-	['*'] = true,
-	['/'] = true,
-	['('] = true,
-	[')'] = true,
-};
-static inline bool issplit(char c)
+#endif
+
+// Skips all spaces at the beginning of the string
+static size_t skipspace(const char *text, size_t start)
+{
+	return scan(text, start, SCAN_NONSPACE);
+}
+
+// Returns the position of the next space in the string
+static size_t nextspace(const char *text, size_t start)
 {
-	return splitchars[(int)c];
+	return scan(text, start, SCAN_SPACE);
 }
 
 // Returns the position of the next split character or space in the string
 static size_t nextsplit(const char *text, size_t start)
 {
-	assert(text);
-	size_t i = start;
-	while (text[i] && !(isspace(text[i]) || issplit(text[i])))
-		i++;
-	return i;
+	return scan(text, start, SCAN_SPACE_SPLIT);
+}
+
+// Classes of items, decided by the first character only
+enum token_class {
+	TC_SYMBOL = 0, // units and sqrt, everything not listed below
+	TC_OPERATOR,   // '*' and '/'
+	TC_BRACKET,    // '(' and ')'
+	TC_NUMBER,     // factors
+};
+
+static const unsigned char token_classes[256] = {
+	['*'] = TC_OPERATOR,
+	['/'] = TC_OPERATOR,
+	['('] = TC_BRACKET,
+	[')'] = TC_BRACKET,
+	['0'] = TC_NUMBER, ['1'] = TC_NUMBER, ['2'] = TC_NUMBER, ['3'] = TC_NUMBER,
+	['4'] = TC_NUMBER, ['5'] = TC_NUMBER, ['6'] = TC_NUMBER, ['7'] = TC_NUMBER,
+	['8'] = TC_NUMBER, ['9'] = TC_NUMBER,
+	['.'] = TC_NUMBER,
+	['+'] = TC_NUMBER,
+	['-'] = TC_NUMBER,
+};
+static inline enum token_class token_class(char c)
+{
+	return token_classes[(unsigned char)c];
 }
 
 static void init_substate(struct substate *sst)
@@ -181,9 +905,9 @@ static void init_substate(struct substate *sst)
 static bool push_unit(struct parser_state *state)
 {
 	state->spos++;
-	debug("Push: %u -> %u", state->spos-1, state->spos);
+	trace("Push: %u -> %u", state->spos-1, state->spos);
 	if (state->spos >= STACK_SIZE) {
-		ERROR("Maximal nesting level exceeded.");
+		ERROR(UL_ERR_SYNTAX, "Maximal nesting level exceeded.");
 		return false;
 	}
 
@@ -199,7 +923,7 @@ static bool push_unit(struct parser_state *state)
 static bool pop_unit(struct parser_state *state, int exp)
 {
 	if (state->spos == 0) {
-		ERROR("Internal error: Stack missmatch!");
+		ERROR(UL_ERR_INTERNAL, "Internal error: Stack missmatch!");
 		return false;
 	}
 	bool sqrt = CURRENT(sqrt, state);
@@ -217,6 +941,28 @@ static bool pop_unit(struct parser_state *state, int exp)
 	return true;
 }
 
+// Parses the exponent in str, which points right after a '^' in item
+static enum result parse_exp(const char *str, const char *item, int *exp)
+{
+	assert(str); assert(item); assert(exp);
+
+	// The '^' should not be the last value of the string
+	if (!*str) {
+		ERROR(UL_ERR_SYNTAX, "Missing exponent after '^' while parsing '%s'", item);
+		return RS_ERROR;
+	}
+
+	char *endptr = NULL;
+	*exp = strtol(str, &endptr, 10);
+
+	// the whole exp string was valid only if *endptr is '\0'
+	if (endptr && *endptr) {
+		ERROR(UL_ERR_SYNTAX, "Invalid exponent at char '%c' while parsing '%s'", *endptr, item);
+		return RS_ERROR;
+	}
+	return RS_HANDLED;
+}
+
 static enum result sym_and_exp(const char *str, char *sym, int *exp)
 {
 	assert(str); assert(sym); assert(exp);
@@ -227,34 +973,16 @@ static enum result sym_and_exp(const char *str, char *sym, int *exp)
 		symend++;
 
 	if (symend >= MAX_SYM_SIZE) {
-		ERROR("Symbol to long");
+		ERROR(UL_ERR_SYNTAX, "Symbol to long");
 		return RS_ERROR;
 	}
 	strncpy(sym, str, symend);
 	sym[symend] = '\0';
 
 	*exp = 1;
-	enum result rs = RS_NOT_MINE;
-
-	if (str[symend]) {
-		// The '^' should not be the last value of the string
-		if (!str[symend+1]) {
-			ERROR("Missing exponent after '^' while parsing '%s'", str);
-			return RS_ERROR;
-		}
-
-		// Parse the exponent
-		char *endptr = NULL;
-		*exp = strtol(str+symend+1, &endptr, 10);
-
-		// the whole exp string was valid only if *endptr is '\0'
-		if (endptr && *endptr) {
-			ERROR("Invalid exponent at char '%c' while parsing '%s'", *endptr, str);
-			return RS_ERROR;
-		}
-		rs = RS_HANDLED;
-	}
-	return rs;
+	if (!str[symend])
+		return RS_NOT_MINE;
+	return parse_exp(str + symend + 1, str, exp);
 }
 
 static enum result handle_bracket_end(const char *str, struct parser_state *state)
@@ -271,143 +999,285 @@ static enum result handle_bracket_end(const char *str, struct parser_state *stat
 	return RS_HANDLED;
 }
 
-static enum result handle_special(const char *str, struct parser_state *state)
+static enum result handle_operator(const char *str, struct parser_state *state)
 {
 	assert(str); assert(state);
 
-	debug("handle_special(%s)", str);
-
-	size_t len = strlen(str);
+	if (str[0] != '*' && str[0] != '/')
+		return RS_NOT_MINE;
 
-	if (state->brkt && (len > 1 || str[0] != '(')) {
-		ERROR("Opening bracket expected after sqrt!");
-		return false;
+	if (state->wasop) {
+		ERROR(UL_ERR_SYNTAX, "Cannot have %c right after %c.", str[0], state->wasop);
+		return RS_ERROR;
 	}
+	// * has no effect, / inverts what follows
+	if (str[0] == '/')
+		CURRENT(sign, state) *= -1;
+	state->wasop = str[0];
+	return RS_HANDLED;
+}
 
-	if (len == 1 || str[0] == ')') {
-		switch (str[0]) {
-
-		case '/':
-			CURRENT(sign, state) *= -1;
-			// big bad fallthrough
-			// * has no effect, and so the error handling
-			// code is not doubled
-		case '*':
-			if (state->wasop) {
-				ERROR("Cannot have %c right after %c.", str[0], state->wasop);
-				return RS_ERROR;
-			}
-			state->wasop = str[0];
-			return RS_HANDLED;
-
-		case '(':
-			state->wasop = '\0';
-			state->brkt = false;
-			if (!push_unit(state))
-				return RS_ERROR;
-			return RS_HANDLED;
-
-		case ')':
-			state->wasop = '\0';
-			return handle_bracket_end(str, state);
-		}
-	}
-	state->wasop = '\0';
+static enum result handle_bracket(const char *str, struct parser_state *state)
+{
+	assert(str); assert(state);
 
-	if (strcmp(str, "sqrt") == 0) {
-		debug("Found sqrt");
-		if (state->spos + 1 < STACK_SIZE)
-			state->nextsqrt = true;
-		state->brkt = true;
+	switch (str[0]) {
+	case '(':
+		state->brkt = false;
+		if (!push_unit(state))
+			return RS_ERROR;
 		return RS_HANDLED;
-	}
 
-	debug("not special!");
+	case ')':
+		return handle_bracket_end(str, state);
+	}
 	return RS_NOT_MINE;
 }
 
+static enum result handle_sqrt(const char *str, struct parser_state *state)
+{
+	assert(str); assert(state);
+
+	if (str[0] != 's' || strcmp(str, "sqrt") != 0)
+		return RS_NOT_MINE;
+
+	trace("Found sqrt");
+	if (state->spos + 1 < STACK_SIZE)
+		state->nextsqrt = true;
+	state->brkt = true;
+	return RS_HANDLED;
+}
+
 static enum result handle_factor(const char *str, struct parser_state *state)
 {
 	assert(str); assert(state);
-	char *endptr;
-	ul_number f = _strton(str, &endptr);
-	if (endptr && *endptr) {
+	ul_number f;
+	int e = 0;
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	if (!_ul_parse_decimal(str, &f, &e)) {
+		return RS_NOT_MINE;
+	}
+#else
+	if (!_ul_parse_number(str, &f)) {
 		return RS_NOT_MINE;
 	}
-	debug("'%s' is a factor", str);
+#endif
+	trace("'%s' is a factor", str);
 
-	CURRENT(unit,state).factor *= _pown(f, CURRENT(sign,state));
+	if (CURRENT(sign,state) < 0) {
+		CURRENT(unit,state).factor /= f;
+		e = -e;
+	}
+	else {
+		CURRENT(unit,state).factor *= f;
+	}
+	if (e)
+		scale_unit(&CURRENT(unit,state), e);
 
 	return RS_HANDLED;
 }
 
-static bool unit_and_prefix(const char *sym, unit_t **unit, ul_number *prefix)
+// Sets the error for the unknown symbol of length len at str. A miss from the
+// cache gets the same message as the lookup that put it there.
+static void unknown_symbol(const char *str, size_t len)
+{
+	if (!get_prefix(str[0])) {
+		ERROR_QUOTED(UL_ERR_SYMBOL, "Unknown symbol: ", str, len, "");
+		return;
+	}
+	char after[] = " with prefix ?";
+	after[sizeof(after) - 2] = str[0];
+	ERROR_QUOTED(UL_ERR_SYMBOL, "Unknown symbol: ", str + 1, len - 1, after);
+}
+
+// Resolves the symbol of length len at the start of str. Both the whole symbol and the symbol without its first
+// character (if that is a prefix) are looked up in the same pass, the whole
+// symbol wins, so "min" is never "m" + "in" and "mm" is milli meter.
+static bool unit_and_prefix(const char *str, size_t len, uint32_t *rule, int *prefix)
 {
-	rule_t *rule = get_rule(sym);
-	if (rule) {
-		*unit = &rule->unit;
-		*prefix = 1.0;
+	int pref = get_prefix(str[0]);
+
+	uint32_t whole = TRIE_ROOT;
+	uint32_t rest  = pref ? TRIE_ROOT : NO_NODE;
+	for (size_t i=0; i < len && (whole != NO_NODE || rest != NO_NODE); ++i) {
+		if (whole != NO_NODE)
+			whole = trie_child(whole, str[i]);
+		if (rest != NO_NODE && i > 0)
+			rest = trie_child(rest, str[i]);
+	}
+
+	if (len >= MAX_SYM_SIZE) {
+		ERROR(UL_ERR_SYNTAX, "Symbol to long");
+		return false;
+	}
+
+	if (whole != NO_NODE && rs->trie[whole].rule != NO_RULE) {
+		*rule = rs->trie[whole].rule;
+		*prefix = 0;
 		return true;
 	}
 
-	char p = sym[0];
-	debug("Got prefix: %c", p);
-	prefix_t *pref = get_prefix(p);
 	if (!pref) {
-		ERROR("Unknown symbol: '%s'", sym);
+		unknown_symbol(str, len);
+		STAT_INC(rule_misses);
+		_ul_cache_insert(str, len, rs->gen);
 		return false;
 	}
+	trace("Got prefix: %c", str[0]);
+	STAT_INC(prefix_lookups);
 
-	rule = get_rule(sym + 1);
-	if (!rule) {
-		ERROR("Unknown symbol: '%s' with prefix %c", sym + 1, p);
+	if (rest == NO_NODE || rs->trie[rest].rule == NO_RULE) {
+		unknown_symbol(str, len);
+		STAT_INC(rule_misses);
+		_ul_cache_insert(str, len, rs->gen);
 		return false;
 	}
 
-	*unit = &rule->unit;
-	*prefix = pref->value;
+	*rule = rs->trie[rest].rule;
+	*prefix = pref;
 	return true;
 }
 
-static enum result handle_unit(const char *str, struct parser_state *state)
+// Returns the static rule with the symbol of length len at str or NO_RULE
+static uint32_t static_rule(const char *str, size_t len)
 {
-	assert(str); assert(state);
-	debug("Parse item: '%s'", str);
-
-	// Split symbol and exponent
-	char symbol[MAX_SYM_SIZE];
-	int exp = 1;
-
-	if (sym_and_exp(str, symbol, &exp) == RS_ERROR) {
-		return RS_ERROR;
+	for (uint32_t i=0; i < NUM_STATIC_RULES; ++i) {
+		const char *sym = static_rules[i].sym.inline_sym;
+		if (sym[0] == str[0] && strncmp(sym, str, len) == 0 && sym[len] == '\0')
+			return i;
 	}
-	exp *= CURRENT(sign, state);
+	return NO_RULE;
+}
 
-	unit_t *rule;
-	ul_number prefix;
-	if (!unit_and_prefix(symbol, &rule, &prefix))
-		return RS_ERROR;
+// Takes the next rule of a replay instead of looking up the symbol. A rule
+// that was redefined since is replaced by the new one.
+static bool replay_unit(const char *str, size_t len, struct deplist *deps, uint32_t *rule, int *prefix)
+{
+	// static symbols are not recorded, they always mean the same
+	uint32_t idx = static_rule(str, len);
+	if (idx != NO_RULE) {
+		*rule = idx;
+		*prefix = 0;
+		return true;
+	}
+
+	idx = deps->idx[deps->replay++];
+	if (rule_at(idx)->flags & RULE_DEAD)
+		idx = get_rule(rule_symbol(rule_at(idx)));
+	if (idx == NO_RULE) {
+		ERROR(UL_ERR_SYMBOL, "Unknown symbol: '%.*s'", (int)len, str);
+		return false;
+	}
+	*rule = idx;
+	*prefix = strlen(rule_symbol(rule_at(idx))) == len ? 0 : get_prefix(str[0]);
+	return true;
+}
+
+static bool add_dep(struct deplist *deps, uint32_t rule)
+{
+	if (deps->num >= deps->cap) {
+		uint32_t cap = deps->cap >= 64 ? deps->cap + deps->cap / 2 : 64; // compact_deps may leave less
+		uint32_t *idx = _ul_realloc(deps->idx, cap * sizeof(*idx));
+		if (!idx) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return false;
+		}
+		deps->idx = idx;
+		deps->cap = cap;
+	}
+	deps->idx[deps->num++] = rule;
+	return true;
+}
+
+static bool wait_rule(struct loader *l, uint32_t rule, uint32_t dep);
+
+static enum result handle_unit(const char *str, struct parser_state *state)
+{
+	assert(str); assert(state);
+	trace("Parse item: '%s'", str);
+
+	size_t symlen = 0;
+	while (str[symlen] && str[symlen] != '^')
+		symlen++;
+
+	uint32_t idx;
+	int prefix;
+	struct deplist *deps = state->deps;
+	if (deps && deps->replay < deps->replay_end) {
+		if (!replay_unit(str, symlen, deps, &idx, &prefix))
+			return RS_ERROR;
+	}
+	else {
+		STAT_INC(rule_lookups);
+		if (_ul_cache_lookup(str, symlen, rs->gen)) {
+			unknown_symbol(str, symlen);
+			STAT_INC(rule_misses);
+			return RS_ERROR;
+		}
+		if (!unit_and_prefix(str, symlen, &idx, &prefix))
+			return RS_ERROR;
+		if (deps && deps->loader && !wait_rule(deps->loader, deps->rule, idx))
+			return RS_ERROR;
+	}
+	if (deps && (idx >= NUM_STATIC_RULES || prefix) && !add_dep(deps, idx))
+		return RS_ERROR;
+	const rule_t *rule = rule_at(idx);
+
+	int exp = 1;
+	if (str[symlen] && parse_exp(str + symlen + 1, str, &exp) == RS_ERROR)
+		return RS_ERROR;
+	exp *= CURRENT(sign, state);
 
 	// And add the definitions
-	add_unit(&CURRENT(unit,state), rule,  exp);
-	CURRENT(unit,state).factor *= _pown(prefix, exp);
+	unit_t def;
+	rule_unit(rule, &def);
+	add_unit(&CURRENT(unit,state), &def, exp);
+	if (prefix)
+		scale_unit(&CURRENT(unit,state), prefix * exp);
 
 	return RS_HANDLED;
 }
 
 static bool handle_item(const char *item, struct parser_state *state)
 {
-	HANDLE_RESULT(handle_special(item, state)); // special has to be the first one!
-	HANDLE_RESULT(handle_factor(item, state));
+	enum token_class tc = token_class(item[0]);
+	trace("Item '%s' has class %d", item, tc);
+	STAT_INC(tokens);
+	TRACEPOINT2(item, item, tc);
+
+	if (state->brkt && item[0] != '(') {
+		ERROR(UL_ERR_SYNTAX, "Opening bracket expected after sqrt!");
+		return false;
+	}
+	if (tc != TC_OPERATOR)
+		state->wasop = '\0';
+
+	switch (tc) {
+	case TC_OPERATOR:
+		HANDLE_RESULT(handle_operator(item, state));
+		break;
+	case TC_BRACKET:
+		HANDLE_RESULT(handle_bracket(item, state));
+		break;
+	case TC_NUMBER:
+		// things like "-kg" are no factors, handle_unit reports them
+		HANDLE_RESULT(handle_factor(item, state));
+		break;
+	case TC_SYMBOL:
+		HANDLE_RESULT(handle_sqrt(item, state));
+		break;
+	}
 	HANDLE_RESULT(handle_unit(item, state));
-	ERROR("Unknown item type for item '%s'", item);
+	ERROR(UL_ERR_SYNTAX, "Unknown item type for item '%s'", item);
 	return false;
 }
 
-UL_API bool ul_parse(const char *str, unit_t *unit)
+// Parses str, the rules used are appended to deps if it's not NULL
+static bool parse_units(const char *str, unit_t *unit, struct deplist *deps)
 {
+	STAT_INC(parse_calls);
 	if (!str || !unit) {
-		ERROR("Invalid paramters");
+		ERROR(UL_ERR_PARAM, "Invalid paramters");
 		return false;
 	}
 	debug("Parse unit: '%s'", str);
@@ -417,6 +1287,7 @@ UL_API bool ul_parse(const char *str, unit_t *unit)
 		.brkt  = false,
 		.wasop = '\0',
 		.nextsqrt = false,
+		.deps  = deps,
 	};
 	init_substate(&state.stack[0]);
 
@@ -432,12 +1303,12 @@ UL_API bool ul_parse(const char *str, unit_t *unit)
 
 		// HACK
 		if ((str[start] == ')') && (str[start+1] == '^')) {
-			debug("Exp hack!");
+			trace("Exp hack!");
 			end = nextsplit(str, start+1);
 		}
 
-		debug("Start: %d", start);
-		debug("End:   %d", end);
+		trace("Start: %d", start);
+		trace("End:   %d", end);
 
 		if (end == start) {
 			if (end == len) // end of string
@@ -447,7 +1318,7 @@ UL_API bool ul_parse(const char *str, unit_t *unit)
 
 		// sanity check
 		if ((end - start) > MAX_ITEM_SIZE ) {
-			ERROR("Item too long");
+			ERROR(UL_ERR_SYNTAX, "Item too long");
 			return false;
 		}
 
@@ -455,7 +1326,7 @@ UL_API bool ul_parse(const char *str, unit_t *unit)
 		strncpy(this_item, str+start, end-start);
 		this_item[end-start] = '\0';
 
-		debug("Item is '%s'", this_item);
+		trace("Item is '%s'", this_item);
 
 		// and handle it
 		if (!handle_item(this_item, &state))
@@ -465,7 +1336,7 @@ UL_API bool ul_parse(const char *str, unit_t *unit)
 	} while (start < len);
 
 	if (state.spos != 0) {
-		ERROR("Bracket missmatch");
+		ERROR(UL_ERR_SYNTAX, "Bracket missmatch");
 		return false;
 	}
 
@@ -474,69 +1345,301 @@ UL_API bool ul_parse(const char *str, unit_t *unit)
 	return true;
 }
 
-static bool add_rule(const char *symbol, const unit_t *unit, bool force)
+static inline bool parse(const char *str, unit_t *unit)
 {
-	assert(symbol);	assert(unit);
-	rule_t *rule = malloc(sizeof(*rule));
-	if (!rule) {
-		ERROR("Failed to allocate memory");
-		return false;
+	return parse_units(str, unit, NULL);
+}
+
+static uint32_t hash_exps(const int16_t exps[NUM_BASE_UNITS])
+{
+	uint32_t h = 2166136261u;
+	for (int i=0; i < NUM_BASE_UNITS; ++i)
+		h = (h ^ (uint16_t)exps[i]) * 16777619u;
+	return h;
+}
+
+static inline rule_src_t *src_at(uint32_t idx)
+{
+	return &rs->srcs[idx - NUM_STATIC_RULES];
+}
+
+// Adds a rule to the exponent index, which has to have room for it. Every
+// slot holds the first rule of a ring, the other rules with the same
+// exponents follow in order of their indices.
+static void index_insert(uint32_t idx)
+{
+	const rule_t *rule = rule_at(idx);
+	rule_src_t *src = src_at(idx);
+	uint32_t mask = rs->num_slots - 1;
+	uint32_t i = hash_exps(rule->exps) & mask;
+	for (; rs->slots[i]; i = (i + 1) & mask) {
+		uint32_t first = rs->slots[i] - 1;
+		if (memcmp(rule_at(first)->exps, rule->exps, sizeof(rule->exps)) != 0)
+			continue;
+		// insert before next, new rules go last right away
+		uint32_t next = first;
+		if (idx > first && idx < src_at(first)->same_prev) {
+			while (next < idx)
+				next = src_at(next)->same_next;
+		}
+		src->same_next = next;
+		src->same_prev = src_at(next)->same_prev;
+		src_at(src->same_prev)->same_next = idx;
+		src_at(next)->same_prev = idx;
+		if (idx < first)
+			rs->slots[i] = idx + 1;
+		return;
 	}
-	rule->next = NULL;
+	src->same_next = idx;
+	src->same_prev = idx;
+	rs->slots[i] = idx + 1;
+	rs->slots_used++;
+}
 
-	rule->symbol = symbol;
-	rule->force  = force;
+// Builds the exponent index from scratch. Without memory there is no index,
+// _ul_reduce scans the rules then and the next index_add tries again.
+static void index_rebuild(void)
+{
+	uint32_t size = rs->num_slots ? rs->num_slots : MIN_SLOTS;
+	while (2 * (rs->num_rules - NUM_STATIC_RULES + 1) > size)
+		size *= 2;
+	if (size != rs->num_slots) {
+		_ul_free(rs->slots);
+		rs->slots = _ul_malloc(size * sizeof(uint32_t));
+		rs->num_slots = rs->slots ? size : 0;
+		if (!rs->slots)
+			return;
+	}
+	memset(rs->slots, 0, size * sizeof(uint32_t));
+	rs->slots_used = 0;
+	for (uint32_t idx = NUM_STATIC_RULES; idx < rs->num_rules; ++idx) {
+		if (!(rule_at(idx)->flags & RULE_DEAD))
+			index_insert(idx);
+	}
+}
 
-	copy_unit(unit, &rule->unit);
+static void index_add(uint32_t idx)
+{
+	// keep the load factor below 1/2
+	if (2 * (rs->slots_used + 1) > rs->num_slots)
+		index_rebuild(); // with idx
+	else
+		index_insert(idx);
+}
 
-	rule_t *last = last_rule();
-	last->next = rule;
+// Takes a rule out of the exponent index, before it dies or its exponents
+// change
+static void index_remove(uint32_t idx)
+{
+	if (!rs->num_slots)
+		return;
+	const rule_t *rule = rule_at(idx);
+	rule_src_t *src = src_at(idx);
+	uint32_t mask = rs->num_slots - 1;
+	uint32_t i = hash_exps(rule->exps) & mask;
+	while (rs->slots[i] && memcmp(rule_at(rs->slots[i] - 1)->exps, rule->exps, sizeof(rule->exps)) != 0)
+		i = (i + 1) & mask;
+	if (!rs->slots[i])
+		return; // not there, see index_rebuild
+
+	if (src->same_next != idx) {
+		src_at(src->same_prev)->same_next = src->same_next;
+		src_at(src->same_next)->same_prev = src->same_prev;
+		if (rs->slots[i] == idx + 1)
+			rs->slots[i] = src->same_next + 1;
+		return;
+	}
 
-	return true;
+	// the last one, the slots after it move back where they can
+	for (uint32_t j = (i + 1) & mask; rs->slots[j]; j = (j + 1) & mask) {
+		uint32_t home = hash_exps(rule_at(rs->slots[j] - 1)->exps) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			rs->slots[i] = rs->slots[j];
+			i = j;
+		}
+	}
+	rs->slots[i] = 0;
+	rs->slots_used--;
 }
 
-static bool add_prefix(char sym, ul_number n)
+// Gives rule idx the unit of to, in the exponent index too
+static void index_move(uint32_t idx, const rule_t *to)
 {
-	prefix_t *pref = malloc(sizeof(*pref));
-	if (!pref) {
-		ERROR("Failed to allocate %d bytes", sizeof(*pref));
-		return false;
+	rule_t *rule = &rs->rules[idx - NUM_STATIC_RULES];
+	bool moved = memcmp(rule->exps, to->exps, sizeof(to->exps)) != 0;
+	if (moved)
+		index_remove(idx);
+	*rule = *to;
+	if (moved)
+		index_add(idx);
+}
+
+// Returns the first living rule after static_rules with the exponents of unit
+static const rule_t *index_find(const unit_t *unit)
+{
+	int16_t exps[NUM_BASE_UNITS];
+	for (int i=0; i < NUM_BASE_UNITS; ++i) {
+		if (unit->exps[i] < INT16_MIN || unit->exps[i] > INT16_MAX)
+			return NULL; // no rule has it
+		exps[i] = (int16_t)unit->exps[i];
 	}
 
-	pref->symbol = sym;
-	pref->value  = n;
-	pref->next = NULL;
+	uint32_t mask = rs->num_slots - 1;
+	for (uint32_t i = hash_exps(exps) & mask; rs->slots[i]; i = (i + 1) & mask) {
+		const rule_t *cur = rule_at(rs->slots[i] - 1);
+		if (memcmp(cur->exps, exps, sizeof(exps)) == 0)
+			return cur;
+	}
+	return NULL;
+}
 
-	prefix_t *last = last_prefix();
-	if (last)
-		last->next = pref;
-	else
-		prefixes = pref;
+// Copies len characters of str and a '\0' to the string pool
+static bool pool_add(const char *str, size_t len, uint32_t *offset)
+{
+	if (rs->pool_size + len + 1 > rs->pool_cap) {
+		uint32_t cap = rs->pool_cap ? rs->pool_cap : 256;
+		while (rs->pool_size + len + 1 > cap)
+			cap *= 2;
+		char *pool = _ul_realloc(rs->pool, cap);
+		if (!pool) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return false;
+		}
+		rs->pool = pool;
+		rs->pool_cap = cap;
+	}
+	memcpy(rs->pool + rs->pool_size, str, len);
+	rs->pool[rs->pool_size + len] = '\0';
+	*offset = rs->pool_size;
+	rs->pool_size += len + 1;
 	return true;
 }
 
-static bool rm_rule(rule_t *rule)
+// Copies symbol into the inline buffer or the string pool of rule
+static bool store_symbol(rule_t *rule, const char *symbol)
 {
-	assert(rule);
-	if (rule->force) {
-		ERROR("Cannot remove forced rule");
+	size_t len = strlen(symbol);
+	if (len < SYM_INLINE) {
+		memcpy(rule->sym.inline_sym, symbol, len + 1);
+		return true;
+	}
+	if (!pool_add(symbol, len, &rule->sym.pool_offset))
 		return false;
+	rule->flags |= RULE_POOLED;
+	return true;
+}
+
+// Copies def without the spaces around it to the string pool
+static bool store_def(rule_src_t *src, const char *def)
+{
+	size_t start = skipspace(def, 0);
+	size_t end = start + strlen(def + start);
+	while (end > start && isspc(def[end - 1]))
+		end--;
+	return pool_add(def + start, end - start, &src->def);
+}
+
+// Checks that the exponents of unit fit into a rule
+static bool check_exps(const char *symbol, const unit_t *unit)
+{
+	for (int i=0; i < NUM_BASE_UNITS; ++i) {
+		if (unit->exps[i] < INT16_MIN || unit->exps[i] > INT16_MAX) {
+			ERROR(UL_ERR_RULE, "Exponent of '%s' is out of range", symbol);
+			return false;
+		}
 	}
+	return true;
+}
 
-	rule_t *cur = dynamic_rules; // base rules cannot be removed
-	rule_t *prev = &base_rules[NUM_BASE_UNITS-1];
+static void set_rule_unit(rule_t *rule, const unit_t *unit)
+{
+	rule->factor = unit->factor;
+	for (int i=0; i < NUM_BASE_UNITS; ++i)
+		rule->exps[i] = (int16_t)unit->exps[i];
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	rule->scale = unit->scale;
+#endif
+}
 
-	while (cur && cur != rule) {
-		prev = cur;
-		cur = cur->next;
+// Appends a rule without a unit and without dependencies, symbol and def are
+// copied. Returns its index, NO_RULE if out of memory or if the symbol is taken.
+static uint32_t new_rule(const char *symbol, const char *def, bool force)
+{
+	assert(symbol); assert(def); assert(!rs->map);
+	uint32_t dyn = rs->num_rules - NUM_STATIC_RULES;
+	if (dyn >= rs->rules_cap) {
+		uint32_t cap = rs->rules_cap ? rs->rules_cap + rs->rules_cap / 2 : 64;
+		rule_t *r = _ul_realloc(rs->rules, cap * sizeof(*r));
+		if (r)
+			rs->rules = r;
+		rule_src_t *src = r ? _ul_realloc(rs->srcs, cap * sizeof(*src)) : NULL;
+		if (!src) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return NO_RULE;
+		}
+		rs->srcs = src;
+		rs->rules_cap = cap;
 	}
 
-	if (cur != rule) {
-		ERROR("Rule not found.");
+	rule_t *rule = &rs->rules[dyn];
+	memset(rule, 0, sizeof(*rule));
+	if (force)
+		rule->flags |= RULE_FORCE;
+	if (!store_symbol(rule, symbol))
+		return NO_RULE;
+
+	rule_src_t *src = &rs->srcs[dyn];
+	memset(src, 0, sizeof(*src));
+	if (!store_def(src, def))
+		return NO_RULE;
+
+	if (!trie_insert(rs->num_rules))
+		return NO_RULE;
+	return rs->num_rules++;
+}
+
+// Appends a rule, symbol and def are copied. The rules def uses are the ones
+// in rs->deps from first_dep on.
+static bool add_rule(const char *symbol, const char *def, const unit_t *unit, bool force, uint32_t first_dep)
+{
+	assert(symbol);	assert(unit);
+	if (!check_exps(symbol, unit))
+		return false;
+
+	uint32_t idx = new_rule(symbol, def, force);
+	if (idx == NO_RULE)
+		return false;
+	set_rule_unit(&rs->rules[idx - NUM_STATIC_RULES], unit);
+	rs->srcs[idx - NUM_STATIC_RULES].first_dep = first_dep;
+	rs->srcs[idx - NUM_STATIC_RULES].num_deps  = rs->deps_size - first_dep;
+	index_add(idx);
+	rules_changed();
+
+	TRACEPOINT2(rule__add, symbol, force);
+	return true;
+}
+
+static bool rm_rule(uint32_t idx)
+{
+	assert(idx < rs->num_rules);
+	const rule_t *rule = rule_at(idx);
+	if (rule->flags & RULE_FORCE) {
+		ERROR(UL_ERR_RULE, "Cannot remove forced rule");
+		return false;
+	}
+	if (rule->flags & RULE_DEAD) {
+		ERROR(UL_ERR_RULE, "Rule not found.");
 		return false;
 	}
 
-	prev->next = rule->next;
+	// the slot stays, so the indices in the trie remain valid
+	trie_remove(idx);
+	index_remove(idx); // another rule may have the same exponents
+	rs->rules[idx - NUM_STATIC_RULES].flags |= RULE_DEAD; // static rules are all forced
+	rs->deps_dead += rs->srcs[idx - NUM_STATIC_RULES].num_deps;
+	rs->srcs[idx - NUM_STATIC_RULES].num_deps = 0;
+	rules_changed();
+	TRACEPOINT1(rule__remove, rule_symbol(rule));
 	return true;
 }
 
@@ -551,9 +1654,10 @@ static bool valid_symbol(const char *sym)
 	return true;
 }
 
-static char *get_symbol(const char *rule, size_t splitpos, bool *force)
+// Copies the symbol of rule to symbol
+static bool get_symbol(const char *rule, size_t splitpos, char symbol[MAX_SYM_SIZE+1], bool *force)
 {
-	assert(rule); assert(force);
+	assert(rule); assert(symbol); assert(force);
 	size_t skip   = skipspace(rule, 0);
 	size_t symend = nextspace(rule, skip);
 	if (symend > splitpos)
@@ -561,17 +1665,17 @@ static char *get_symbol(const char *rule, size_t splitpos, bool *force)
 
 	if (skipspace(rule,symend) != splitpos) {
 		// rule was something like "a b = kg"
-		ERROR("Invalid symbol, whitespaces are not allowed.");
-		return NULL;
+		ERROR(UL_ERR_RULE, "Invalid symbol, whitespaces are not allowed.");
+		return false;
 	}
 
 	if ((symend-skip) > MAX_SYM_SIZE) {
-		ERROR("Symbol to long");
-		return NULL;
+		ERROR(UL_ERR_SYNTAX, "Symbol to long");
+		return false;
 	}
 	if ((symend-skip) == 0) {
-		ERROR("Empty symbols are not allowed.");
-		return NULL;
+		ERROR(UL_ERR_RULE, "Empty symbols are not allowed.");
+		return false;
 	}
 
 	if (rule[skip] == '!') {
@@ -583,102 +1687,421 @@ static char *get_symbol(const char *rule, size_t splitpos, bool *force)
 		*force = false;
 	}
 
-	debug("Allocate %d bytes", symend-skip + 1);
-	char *symbol = malloc(symend-skip + 1);
-	if (!symbol) {
-		ERROR("Failed to allocate memory");
-		return NULL;
-	}
-
 	strncpy(symbol, rule + skip, symend-skip);
 	symbol[symend-skip] = '\0';
 	debug("Symbol is '%s'", symbol);
 
-	return symbol;
+	return true;
 }
 
-// parses a string like "symbol = def"
-UL_API bool ul_parse_rule(const char *rule)
+// Splits a string like "symbol = def", def points into rule afterwards
+static bool split_rule(const char *rule, char symbol[MAX_SYM_SIZE+1], bool *force, const char **def)
 {
-	if (!rule) {
-		ERROR("Invalid parameter");
-		return false;
-	}
-
 	// split symbol and definition
 	size_t len = strlen(rule);
 	size_t splitpos = 0;
 
-	debug("Parsing rule '%s'", rule);
-
 	for (size_t i=0; i < len; ++i) {
 		if (rule[i] == '=') {
-			debug("Split at %d", i);
+			trace("Split at %d", i);
 			splitpos = i;
 			break;
 		}
 	}
 	if (!splitpos) {
-		ERROR("Missing '=' in rule definition '%s'", rule);
+		ERROR(UL_ERR_RULE, "Missing '=' in rule definition '%s'", rule);
 		return false;
 	}
 
 	// Get the symbol
-	bool force = false;
-	char *symbol = get_symbol(rule, splitpos, &force);
-	if (!symbol)
+	if (!get_symbol(rule, splitpos, symbol, force))
 		return false;
 
 	if (!valid_symbol(symbol)) {
-		ERROR("Symbol '%s' is invalid.", symbol);
-		free(symbol);
+		ERROR(UL_ERR_RULE, "Symbol '%s' is invalid.", symbol);
+		return false;
+	}
+
+	*def = rule + splitpos + 1; // ommiting the '='
+	return true;
+}
+
+// Parses the definition of a rule, the rules it uses are appended to
+// rs->deps. With replay the rules are the ones rule replay used last time.
+static bool parse_def(const char *def, unit_t *unit, uint32_t replay)
+{
+	struct deplist deps = { rs->deps, rs->deps_size, rs->deps_cap, 0, 0, NULL, 0 };
+	if (replay != NO_RULE) {
+		const rule_src_t *src = &rs->srcs[replay - NUM_STATIC_RULES];
+		deps.replay     = src->first_dep;
+		deps.replay_end = src->first_dep + src->num_deps;
+	}
+	bool ok = parse_units(def, unit, &deps);
+	rs->deps     = deps.idx;
+	rs->deps_cap = deps.cap;
+	if (ok)
+		rs->deps_size = deps.num;
+	return ok;
+}
+
+// Records that user uses rule. If there is no memory, the lists of users
+// are rebuilt by the next find_users.
+static void add_use(uint32_t rule, uint32_t user)
+{
+	if (rule < NUM_STATIC_RULES)
+		return; // they cannot be redefined
+	rule_src_t *src = src_at(rule);
+	if (src->first_user != NO_USE && rs->uses[src->first_user].user == user)
+		return; // used twice
+	if (!rs->uses_size)
+		rs->uses_size = NO_USE + 1;
+	if (rs->uses_size >= rs->uses_cap) {
+		uint32_t cap = rs->uses_cap ? rs->uses_cap + rs->uses_cap / 2 : 64;
+		rule_use_t *uses = _ul_realloc(rs->uses, cap * sizeof(*uses));
+		if (!uses) {
+			rs->uses_lost = true;
+			return;
+		}
+		rs->uses = uses;
+		rs->uses_cap = cap;
+	}
+	rs->uses[rs->uses_size].user = user;
+	rs->uses[rs->uses_size].next = src->first_user;
+	src->first_user = rs->uses_size++;
+}
+
+// Records the rules rule uses
+static void add_uses(uint32_t rule)
+{
+	const rule_src_t *src = src_at(rule);
+	for (uint32_t d=0; d < src->num_deps; ++d)
+		add_use(rs->deps[src->first_dep + d], rule);
+}
+
+// Builds the lists of users from the rules each rule uses, without the
+// entries of dead users
+static bool rebuild_uses(void)
+{
+	rs->uses_size = 0;
+	rs->uses_lost = false;
+	for (uint32_t idx = NUM_STATIC_RULES; idx < rs->num_rules; ++idx)
+		src_at(idx)->first_user = NO_USE;
+	for (uint32_t idx = NUM_STATIC_RULES; idx < rs->num_rules; ++idx)
+		add_uses(idx); // dead rules use nothing
+	if (rs->uses_lost) {
+		ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
 		return false;
 	}
+	return true;
+}
+
+// The rules that use a rule, directly or indirectly, every rule comes after
+// the rules it uses
+struct users
+{
+	uint32_t *order; // by rule - NUM_STATIC_RULES
+	uint32_t num;
+	uint32_t cap;
+	uint32_t mark;   // in the rule_src_t of the rule and its users
+};
 
-	rule_t *old_rule = NULL;
-	if ((old_rule = get_rule(symbol)) != NULL) {
-		if (old_rule->force || !force) {
-			ERROR("You may not redefine '%s'", symbol);
-			free(symbol);
+static void free_users(struct users *users)
+{
+	_ul_free(users->order);
+}
+
+static inline bool is_user(const struct users *users, uint32_t rule)
+{
+	return rule >= NUM_STATIC_RULES && src_at(rule)->mark == users->mark;
+}
+
+static bool push_user(struct users *users, uint32_t rule)
+{
+	if (users->num >= users->cap) {
+		uint32_t cap = users->cap ? users->cap + users->cap / 2 : 16;
+		uint32_t *order = _ul_realloc(users->order, cap * sizeof(*order));
+		if (!order) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
 			return false;
 		}
-		// remove the old rule, so it cannot be used in the definition
-		// of the new one, so something like "!R = R" is not possible
-		if (force) {
-			if (!rm_rule(old_rule)) {
-				free(symbol);
-				return false;
+		users->order = order;
+		users->cap = cap;
+	}
+	users->order[users->num++] = rule - NUM_STATIC_RULES;
+	return true;
+}
+
+// Returns the next living user in the list at use
+static uint32_t next_user(uint32_t *use)
+{
+	while (*use != NO_USE) {
+		uint32_t user = rs->uses[*use].user;
+		*use = rs->uses[*use].next;
+		if (!(rule_at(user)->flags & RULE_DEAD))
+			return user;
+	}
+	return NO_RULE;
+}
+
+// Finds the users of rule through the lists of users, so it takes time in
+// the number of users and what they use only
+static bool find_users(uint32_t rule, struct users *users)
+{
+	users->order = NULL;
+	users->num   = 0;
+	users->cap   = 0;
+	if (rs->uses_lost && !rebuild_uses())
+		return false;
+	if (++rs->last_mark == 0) {
+		for (uint32_t idx = NUM_STATIC_RULES; idx < rs->num_rules; ++idx)
+			src_at(idx)->mark = 0;
+		rs->last_mark = 1;
+	}
+	users->mark = rs->last_mark;
+
+	// mark everything reachable, pending becomes the number of uses by
+	// marked rules
+	src_at(rule)->mark = users->mark;
+	if (!push_user(users, rule))
+		return false;
+	for (uint32_t q=0; q < users->num; ++q) {
+		uint32_t use = src_at(users->order[q] + NUM_STATIC_RULES)->first_user;
+		for (uint32_t user; (user = next_user(&use)) != NO_RULE;) {
+			rule_src_t *src = src_at(user);
+			if (src->mark != users->mark) {
+				src->mark = users->mark;
+				src->pending = 0;
+				if (!push_user(users, user)) {
+					free_users(users);
+					return false;
+				}
 			}
+			src->pending++;
 		}
 	}
 
-	rule = rule + splitpos + 1; // ommiting the '='
-	debug("Rest definition is '%s'", rule);
+	// sort them topologically, a rule comes once all its uses are done
+	uint32_t num = 1;
+	for (uint32_t q=0; q < num; ++q) {
+		uint32_t use = src_at(users->order[q] + NUM_STATIC_RULES)->first_user;
+		for (uint32_t user; (user = next_user(&use)) != NO_RULE;) {
+			if (--src_at(user)->pending == 0)
+				users->order[num++] = user - NUM_STATIC_RULES;
+		}
+	}
+	users->num = num;
+	return true;
+}
+
+// Drops the entries of rs->deps no rule refers to anymore
+static void compact_deps(void)
+{
+	uint32_t size = rs->deps_size - rs->deps_dead;
+	uint32_t *deps = _ul_malloc((size ? size : 1) * sizeof(uint32_t));
+	if (!deps)
+		return; // they stay
+	uint32_t pos = 0;
+	for (uint32_t i=0; i < rs->num_rules - NUM_STATIC_RULES; ++i) {
+		rule_src_t *src = &rs->srcs[i];
+		memcpy(deps + pos, rs->deps + src->first_dep, src->num_deps * sizeof(uint32_t));
+		src->first_dep = pos;
+		pos += src->num_deps;
+	}
+	_ul_free(rs->deps);
+	rs->deps      = deps;
+	rs->deps_size = pos;
+	rs->deps_cap  = size ? size : 1;
+	rs->deps_dead = 0;
+	rebuild_uses(); // drops the dead users, too
+}
+
+// Recomputes the users of a redefined rule from their definitions, with the
+// same rules as before, only the redefined one is replaced by the new one.
+// So a symbol defined since never changes what a definition means. If one
+// of them fails, all of them keep their old units.
+static bool update_users(const struct users *users)
+{
+	// the users as they were, order[0] is the redefined rule
+	rule_t     *rules = _ul_malloc((users->num ? users->num : 1) * sizeof(rule_t));
+	rule_src_t *srcs  = _ul_malloc((users->num ? users->num : 1) * sizeof(rule_src_t));
+	if (!rules || !srcs) {
+		ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+		_ul_free(rules);
+		_ul_free(srcs);
+		return false;
+	}
+	uint32_t deps_size = rs->deps_size;
+	uint32_t deps_dead = rs->deps_dead;
+
+	uint32_t u;
+	for (u=1; u < users->num; ++u) {
+		uint32_t idx = users->order[u] + NUM_STATIC_RULES;
+		rule_t *rule = &rs->rules[idx - NUM_STATIC_RULES];
+		rules[u] = *rule;
+		srcs[u]  = *src_at(idx);
+		const char *def = rs->pool + srcs[u].def;
+		debug("Recomputing '%s' = '%s'", rule_symbol(rule), def);
+
+		uint32_t first_dep = rs->deps_size;
+		unit_t unit;
+		if (!parse_def(def, &unit, idx) || !check_exps(rule_symbol(rule), &unit))
+			break;
+		rule_src_t *src = src_at(idx);
+		rs->deps_dead += src->num_deps;
+		src->first_dep = first_dep;
+		src->num_deps  = rs->deps_size - first_dep;
+		rule_t updated = *rule;
+		set_rule_unit(&updated, &unit);
+		index_move(idx, &updated);
+	}
+	bool ok = u >= users->num;
+	if (!ok) {
+		// the new deps of the rules done so far are the last ones
+		while (--u > 0) {
+			uint32_t idx = users->order[u] + NUM_STATIC_RULES;
+			index_move(idx, &rules[u]);
+			src_at(idx)->first_dep = srcs[u].first_dep;
+			src_at(idx)->num_deps  = srcs[u].num_deps;
+		}
+		rs->deps_size = deps_size;
+		rs->deps_dead = deps_dead;
+	}
+	else {
+		// the replay took the same rules, but for the redefined ones
+		for (u=1; u < users->num; ++u) {
+			uint32_t idx = users->order[u] + NUM_STATIC_RULES;
+			const rule_src_t *src = src_at(idx);
+			for (uint32_t d=0; d < src->num_deps; ++d) {
+				uint32_t dep = rs->deps[src->first_dep + d];
+				if (d >= srcs[u].num_deps || dep != rs->deps[srcs[u].first_dep + d])
+					add_use(dep, idx);
+			}
+		}
+	}
+	_ul_free(rules);
+	_ul_free(srcs);
+	if (!ok)
+		return false;
+
+	if (users->num > 1)
+		rules_changed();
+	if (rs->deps_dead > rs->deps_size / 2)
+		compact_deps();
+	return true;
+}
+
+// Undoes rm_rule, the rule used num_deps rules
+static void revive_rule(uint32_t idx, uint32_t num_deps)
+{
+	rs->rules[idx - NUM_STATIC_RULES].flags &= ~RULE_DEAD;
+	rs->srcs[idx - NUM_STATIC_RULES].num_deps = num_deps;
+	rs->deps_dead -= num_deps;
+	trie_insert(idx); // its node is still there
+	index_add(idx);
+}
+
+// parses a string like "symbol = def"
+static bool parse_rule(const char *rule)
+{
+	if (!rule) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+	if (rs->map) {
+		ERROR(UL_ERR_RULE, "Attached rules are read only");
+		return false;
+	}
+
+	debug("Parsing rule '%s'", rule);
+
+	bool force = false;
+	char symbol[MAX_SYM_SIZE+1];
+	const char *def;
+	if (!split_rule(rule, symbol, &force, &def))
+		return false;
+
+	uint32_t old_rule = get_rule(symbol);
+	if (old_rule != NO_RULE && ((rule_at(old_rule)->flags & RULE_FORCE) || !force)) {
+		ERROR(UL_ERR_RULE, "You may not redefine '%s'", symbol);
+		return false;
+	}
+
+	debug("Rest definition is '%s'", def);
 
+	// nothing changes before the new rule is in place, so a refused rule
+	// leaves everything as it was
+	uint32_t num_rules = rs->num_rules;
+	uint32_t pool_size = rs->pool_size;
+	uint32_t trie_size = rs->trie_size;
+	uint32_t first_dep = rs->deps_size;
 	unit_t unit;
-	if (!ul_parse(rule, &unit)) {
-		free(symbol);
+	if (!parse_def(def, &unit, NO_RULE))
 		return false;
+
+	// the new definition may not use the old rule or its users, so
+	// something like "!R = R" is not possible
+	struct users users = { NULL, 0, 0, 0 };
+	bool ok = true;
+	if (old_rule != NO_RULE) {
+		ok = find_users(old_rule, &users);
+		for (uint32_t d = first_dep; ok && d < rs->deps_size; ++d) {
+			if (is_user(&users, rs->deps[d])) {
+				ERROR(UL_ERR_RULE, "'%s' would depend on itself", symbol);
+				ok = false;
+			}
+		}
+	}
+	if (!ok) {
+		free_users(&users);
+		rs->deps_size = first_dep;
+		return false;
+	}
+
+	uint32_t old_deps = 0;
+	if (old_rule != NO_RULE) {
+		old_deps = rs->srcs[old_rule - NUM_STATIC_RULES].num_deps;
+		rm_rule(old_rule); // not forced and alive, so it cannot fail
+	}
+	ok = add_rule(symbol, def, &unit, force, first_dep) && update_users(&users);
+	free_users(&users);
+	if (ok) {
+		add_uses(rs->num_rules - 1);
+		return true;
 	}
 
-	return add_rule(symbol, &unit, force);
+	if (rs->num_rules > num_rules) {
+		index_remove(rs->num_rules - 1);
+		trie_remove(rs->num_rules - 1);
+		rs->num_rules--;
+	}
+	trie_truncate(trie_size);
+	if (old_rule != NO_RULE)
+		revive_rule(old_rule, old_deps);
+	rs->deps_size = first_dep;
+	rs->pool_size = pool_size;
+	rules_changed();
+	return false;
 }
 
-UL_API bool ul_load_rules(const char *path)
+enum {
+	MAX_LINE = 1024, // longer lines are split
+};
+
+static bool load_rules(const char *path)
 {
 	FILE *f = fopen(path, "r");
 	if (!f) {
-		ERROR("Failed to open file '%s'", path);
+		ERROR(UL_ERR_IO, "Failed to open file '%s'", path);
 		return false;
 	}
 
 	bool ok = true;
-	char line[1024];
-	while (fgets(line, 1024, f)) {
+	char line[MAX_LINE];
+	while (fgets(line, MAX_LINE, f)) {
 		size_t skip = skipspace(line, 0);
 		if (!line[skip] || line[skip] == '#')
 			continue; // empty line or comment
-		ok = ul_parse_rule(line);
+		ok = parse_rule(line);
 		if (!ok)
 			break;
 	}
@@ -686,114 +2109,870 @@ UL_API bool ul_load_rules(const char *path)
 	return ok;
 }
 
-UL_LINKAGE const char *_ul_reduce(const unit_t *unit)
+/*
+ * The parallel loader first reserves all rules of a file in file order, so
+ * they get the same indices as with load_rules. Then the workers take the
+ * rules in file order too, look up the rules of the file each definition
+ * depends on and wait until those are parsed. A rule only depends on
+ * earlier ones, so the oldest unfinished rule never waits. The trie and the
+ * pool don't change while the workers run.
+ *
+ * Whenever the result could differ from load_rules (forced or redefined
+ * rules, symbols used before their definition, errors), the reserved rules
+ * are dropped and the file is loaded by load_rules.
+ */
+struct loader
+{
+	struct ul_ruleset *set;
+	uint32_t    first;  // index of the first rule of the file
+	uint32_t    num;    // number of rules in the file
+	const char  **defs; // definition of every rule
+	unsigned char *done; // set once a rule is parsed
+	unsigned    *owner; // the worker that parsed a rule
+	uint32_t    next;   // next rule to take
+	int         failed;
+#ifdef HAS_THREADS
+	// workers waiting for a rule sleep on cond until it's done
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	int             waiting; // number of sleeping workers
+#endif
+};
+
+// The rules of a definition are at rs->srcs[].first_dep in deps of the
+// worker that parsed it until all workers are done
+struct worker
+{
+	struct loader  *l;
+	unsigned       id;
+	struct deplist deps;
+
+	// what the worker counts, dropped if the file is loaded sequentially
+	ul_stats_t       stats;
+	ul_cache_stats_t cache;
+};
+
+// Reads the whole file into a NUL terminated buffer
+static char *read_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		ERROR(UL_ERR_IO, "Failed to open file '%s'", path);
+		return NULL;
+	}
+	char *buffer = NULL;
+	long len = -1;
+	if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0)
+		buffer = _ul_malloc(len + 1);
+	if (!buffer || fread(buffer, 1, len, f) != (size_t)len) {
+		ERROR(UL_ERR_IO, "Failed to read file '%s'", path);
+		_ul_free(buffer);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	buffer[len] = '\0';
+	*size = len;
+	return buffer;
+}
+
+// Reserves the rules of the file, false if load_rules has to load it
+static bool reserve_rules(struct loader *l, char *buffer)
 {
-	for (rule_t *cur = rules; cur; cur = cur->next) {
-		if (ul_cmp(&cur->unit, unit) & UL_SAME_UNIT)
-			return cur->symbol;
+	char *line = buffer;
+	while (*line) {
+		char *end = strchr(line, '\n');
+		char *next = end ? end + 1 : line + strlen(line);
+		if (end)
+			*end = '\0';
+		else
+			end = next;
+		if (end - line >= MAX_LINE - 1)
+			return false; // load_rules would split it
+
+		size_t skip = skipspace(line, 0);
+		if (line[skip] && line[skip] != '#') {
+			bool force;
+			char symbol[MAX_SYM_SIZE+1];
+			const char *def;
+			if (!split_rule(line, symbol, &force, &def) || force)
+				return false;
+			if (new_rule(symbol, def, false) == NO_RULE)
+				return false; // also if the symbol is taken
+			l->defs[l->num++] = def;
+		}
+		line = next;
 	}
+	return true;
+}
+
+// Waits until rule i of the file is parsed, false if it never will be
+static bool wait_done(struct loader *l, uint32_t i)
+{
+	if (LOAD_ACQUIRE(l->done[i]))
+		return true;
+#ifdef HAS_THREADS
+	// mark_done reads waiting after setting done, and we read done after
+	// counting us, so one of us sees the other
+	pthread_mutex_lock(&l->lock);
+	__atomic_add_fetch(&l->waiting, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&l->done[i], __ATOMIC_SEQ_CST) && !LOAD_ACQUIRE(l->failed))
+		pthread_cond_wait(&l->cond, &l->lock);
+	__atomic_sub_fetch(&l->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&l->lock);
+#endif
+	return LOAD_ACQUIRE(l->done[i]);
+}
+
+// Marks rule i of the file as parsed or, with failed, all workers as done
+static void mark_done(struct loader *l, uint32_t i, bool failed)
+{
+#ifdef HAS_THREADS
+	if (failed)
+		STORE_RELEASE(l->failed, 1);
+	else
+		__atomic_store_n(&l->done[i], 1, __ATOMIC_SEQ_CST);
+	if (failed || __atomic_load_n(&l->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&l->lock);
+		pthread_cond_broadcast(&l->cond);
+		pthread_mutex_unlock(&l->lock);
+	}
+#else
+	if (failed)
+		l->failed = 1;
+	else
+		l->done[i] = 1;
+#endif
+}
+
+// Waits until rule dep, that rule uses, is parsed. False if it never will
+// be, or if dep comes after rule, load_rules wouldn't have found it then.
+static bool wait_rule(struct loader *l, uint32_t rule, uint32_t dep)
+{
+	if (dep >= rule)
+		return false;
+	return dep < l->first || wait_done(l, dep - l->first);
+}
+
+// Parses rules until all are taken, together with the other workers
+static void *load_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct loader *l = w->l;
+	struct ul_ruleset *saved = rs;
+	rs = l->set;
+	ul_stats_t *stats = local_stats();
+	ul_cache_stats_t *cache = _ul_local_cache_stats;
+	_ul_local_stats = &w->stats;
+	_ul_local_cache_stats = &w->cache;
+
+	while (!LOAD_ACQUIRE(l->failed)) {
+#ifdef __GNUC__
+		uint32_t i = __sync_fetch_and_add(&l->next, 1);
+#else
+		uint32_t i = l->next++;
+#endif
+		if (i >= l->num)
+			break;
+		rule_t *rule = &rs->rules[l->first + i - NUM_STATIC_RULES];
+		rule_src_t *src = &rs->srcs[l->first + i - NUM_STATIC_RULES];
+
+		unit_t unit;
+		uint32_t first_dep = w->deps.num;
+		w->deps.loader = l;
+		w->deps.rule   = l->first + i;
+		if (!parse_units(l->defs[i], &unit, &w->deps) || !check_exps(rule_symbol(rule), &unit)) {
+			mark_done(l, i, true);
+			break;
+		}
+		set_rule_unit(rule, &unit);
+		src->first_dep = first_dep;
+		src->num_deps  = w->deps.num - first_dep;
+		l->owner[i] = w->id;
+		mark_done(l, i, false);
+	}
+
+	_ul_local_stats = stats;
+	_ul_local_cache_stats = cache;
+	rs = saved;
 	return NULL;
 }
 
-static bool kilogram_hack(void)
+#ifdef HAS_THREADS
+static void *worker_thread(void *arg)
 {
-	// stupid inconsistend SI system...
-	unit_t gram = {
-		{[U_KILOGRAM] = 1},
-		1e-3,
-	};
-	if (!add_rule(strdup("g"), &gram, true)) // strdup because add_rule expects malloc'd memory (it gets free'd at ul_quit)
+	load_worker(arg);
+	_ul_release_stats(); // the thread is gone, its counters stay
+	return NULL;
+}
+#endif
+
+// Appends the rules the definitions of the file use to rs->deps
+static bool collect_deps(struct loader *l, struct worker *workers, unsigned num_workers)
+{
+	uint32_t total = 0;
+	for (unsigned w=0; w < num_workers; ++w)
+		total += workers[w].deps.num;
+	if (rs->deps_size + total > rs->deps_cap) {
+		uint32_t *deps = _ul_realloc(rs->deps, (rs->deps_size + total) * sizeof(uint32_t));
+		if (!deps) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return false;
+		}
+		rs->deps = deps;
+		rs->deps_cap = rs->deps_size + total;
+	}
+
+	for (uint32_t i=0; i < l->num; ++i) {
+		rule_src_t *src = &rs->srcs[l->first + i - NUM_STATIC_RULES];
+		const struct deplist *deps = &workers[l->owner[i]].deps;
+		memcpy(rs->deps + rs->deps_size, deps->idx + src->first_dep, src->num_deps * sizeof(uint32_t));
+		src->first_dep = rs->deps_size;
+		rs->deps_size += src->num_deps;
+	}
+	return true;
+}
+
+// Parses the reserved rules with threads workers, false if one failed
+static bool run_workers(struct loader *l, unsigned threads)
+{
+	struct worker *workers = _ul_calloc(threads, sizeof(*workers));
+	if (!workers) {
+		ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+		return false;
+	}
+	for (unsigned w=0; w < threads; ++w) {
+		workers[w].l  = l;
+		workers[w].id = w;
+	}
+
+#ifdef HAS_THREADS
+	pthread_t *tids = _ul_malloc((threads - 1) * sizeof(pthread_t));
+	unsigned started = 0;
+	if (tids) {
+		for (; started + 1 < threads; ++started) {
+			if (pthread_create(&tids[started], NULL, worker_thread, &workers[started + 1]) != 0)
+				break;
+		}
+	}
+
+	load_worker(&workers[0]);
+	for (unsigned i=0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+	_ul_free(tids);
+#else
+	load_worker(&workers[0]);
+#endif
+
+	bool ok = !l->failed && collect_deps(l, workers, threads);
+	for (unsigned w=0; w < threads; ++w) {
+		if (ok)
+			_ul_add_stats(&workers[w].stats, &workers[w].cache);
+		_ul_free(workers[w].deps.idx);
+	}
+	_ul_free(workers);
+	return ok;
+}
+
+static unsigned num_cpus(void)
+{
+#if defined(HAS_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+static bool load_rules_parallel(const char *path, unsigned threads)
+{
+	if (!threads)
+		threads = num_cpus();
+	if (threads == 1 || rs->map)
+		return load_rules(path);
+
+	size_t size;
+	char *buffer = read_file(path, &size);
+	if (!buffer)
+		return false;
+
+	size_t lines = 1;
+	for (size_t i=0; i < size; ++i)
+		lines += buffer[i] == '\n';
+
+	struct loader l;
+	memset(&l, 0, sizeof(l));
+	l.set   = rs;
+	l.first = rs->num_rules;
+	l.defs  = _ul_malloc(lines * sizeof(*l.defs));
+	l.done  = _ul_calloc(lines, 1);
+	l.owner = _ul_malloc(lines * sizeof(*l.owner));
+	uint32_t pool_size = rs->pool_size;
+	uint32_t trie_size = rs->trie_size;
+#ifdef HAS_THREADS
+	pthread_mutex_init(&l.lock, NULL);
+	pthread_cond_init(&l.cond, NULL);
+#endif
+
+	bool ok = l.defs && l.done && l.owner && reserve_rules(&l, buffer);
+	if (ok) {
+		debug("Loading %u rules with %u threads", l.num, threads);
+		rules_changed(); // no cached misses of the new symbols
+		ok = run_workers(&l, threads);
+	}
+
+	if (ok) {
+		for (uint32_t i=0; i < l.num; ++i) {
+			index_add(l.first + i);
+			add_uses(l.first + i);
+			TRACEPOINT2(rule__add, rule_symbol(rule_at(l.first + i)), false);
+		}
+	}
+	else {
+		debug("Loading '%s' sequentially", path);
+		for (uint32_t idx = l.first; idx < rs->num_rules; ++idx)
+			trie_remove(idx);
+		trie_truncate(trie_size);
+		rs->num_rules = l.first;
+		rs->pool_size = pool_size;
+	}
+	rules_changed();
+
+#ifdef HAS_THREADS
+	pthread_cond_destroy(&l.cond);
+	pthread_mutex_destroy(&l.lock);
+#endif
+	_ul_free(l.owner);
+	_ul_free(l.done);
+	_ul_free(l.defs);
+	_ul_free(buffer);
+	return ok || load_rules(path);
+}
+
+/*
+ * A published rule set is a header followed by the rules after the static
+ * ones, the string pool, the trie, its edges and the exponent index. They only refer to each other by
+ * indices and offsets, so the file can be mapped at any address and be
+ * shared by all processes that attach it.
+ */
+#define SHARED_MAGIC   "ulrules"
+#define SHARED_VERSION 3
+
+#ifdef UL_HAS_DECIMAL_EXPONENT
+#define SHARED_CONFIG 1
+#else
+#define SHARED_CONFIG 0
+#endif
+
+enum {
+	SHARED_ALIGN = 16, // of every section
+};
+
+struct shared_header
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t config;      // SHARED_CONFIG
+	uint16_t number_size; // sizeof(ul_number)
+	uint16_t rule_size;   // sizeof(rule_t)
+	uint16_t node_size;   // sizeof(trie_node_t)
+	uint16_t num_static;  // NUM_STATIC_RULES
+	uint32_t num_rules;   // including the static rules
+	uint32_t pool_size;
+	uint32_t trie_size;
+	uint32_t num_edges;
+	uint32_t num_slots;
+	uint64_t rules_off;
+	uint64_t pool_off;
+	uint64_t trie_off;
+	uint64_t edges_off;
+	uint64_t slots_off;
+	uint64_t size;        // of the whole file
+};
+
+static inline uint64_t shared_align(uint64_t off)
+{
+	return (off + SHARED_ALIGN - 1) & ~(uint64_t)(SHARED_ALIGN - 1);
+}
+
+// Writes len bytes of data and pads them up to the next section
+static bool write_section(FILE *f, const void *data, size_t len)
+{
+	static const char zeros[SHARED_ALIGN];
+	if (len && fwrite(data, 1, len, f) != len)
 		return false;
+	size_t pad = shared_align(len) - len;
+	return fwrite(zeros, 1, pad, f) == pad;
+}
+
+static bool publish_rules(const char *path)
+{
+	struct shared_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SHARED_MAGIC, sizeof(SHARED_MAGIC));
+	hdr.version     = SHARED_VERSION;
+	hdr.config      = SHARED_CONFIG;
+	hdr.number_size = sizeof(ul_number);
+	hdr.rule_size   = sizeof(rule_t);
+	hdr.node_size   = sizeof(trie_node_t);
+	hdr.num_static  = NUM_STATIC_RULES;
+	hdr.num_rules   = rs->num_rules;
+	hdr.pool_size   = rs->pool_size;
+	hdr.trie_size   = rs->trie_size;
+	hdr.num_edges   = rs->num_edges;
+	hdr.num_slots   = rs->num_slots;
+
+	size_t rules_len = (size_t)(rs->num_rules - NUM_STATIC_RULES) * sizeof(rule_t);
+	size_t trie_len  = (size_t)rs->trie_size * sizeof(trie_node_t);
+	size_t edges_len = (size_t)rs->num_edges * sizeof(uint32_t);
+	size_t slots_len = (size_t)rs->num_slots * sizeof(uint32_t);
+	hdr.rules_off = shared_align(sizeof(hdr));
+	hdr.pool_off  = hdr.rules_off + shared_align(rules_len);
+	hdr.trie_off  = hdr.pool_off + shared_align(rs->pool_size);
+	hdr.edges_off = hdr.trie_off + shared_align(trie_len);
+	hdr.slots_off = hdr.edges_off + shared_align(edges_len);
+	hdr.size      = hdr.slots_off + shared_align(slots_len);
+
+	// write a new file and rename it, so nobody maps a half written one
+	char tmp[FILENAME_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		ERROR(UL_ERR_PARAM, "Path '%s' is too long", path);
+		return false;
+	}
+	FILE *f = fopen(tmp, "wb");
+	if (!f) {
+		ERROR(UL_ERR_IO, "Failed to open file '%s'", tmp);
+		return false;
+	}
+	bool ok = write_section(f, &hdr, sizeof(hdr))
+	       && write_section(f, rs->rules, rules_len)
+	       && write_section(f, rs->pool, rs->pool_size)
+	       && write_section(f, rs->trie, trie_len)
+	       && write_section(f, rs->edges, edges_len)
+	       && write_section(f, rs->slots, slots_len);
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok || rename(tmp, path) != 0) {
+		ERROR(UL_ERR_IO, "Failed to write file '%s'", path);
+		remove(tmp);
+		return false;
+	}
+	debug("Published %u rules to '%s'", rs->num_rules, path);
 	return true;
 }
 
-static void free_rules(void)
+#ifdef HAS_MMAP
+// Checks that the header fits this build and all sections fit into size
+static bool valid_header(const struct shared_header *hdr, size_t size)
+{
+	if (memcmp(hdr->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC)) != 0
+	    || hdr->version != SHARED_VERSION || hdr->config != SHARED_CONFIG
+	    || hdr->number_size != sizeof(ul_number) || hdr->rule_size != sizeof(rule_t)
+	    || hdr->node_size != sizeof(trie_node_t) || hdr->num_static != NUM_STATIC_RULES)
+		return false;
+	if (hdr->size != size || hdr->num_rules < NUM_STATIC_RULES || hdr->trie_size <= TRIE_ROOT)
+		return false;
+	if (!hdr->num_edges || (hdr->num_edges & (hdr->num_edges - 1)) || (hdr->num_slots & (hdr->num_slots - 1)))
+		return false; // not a power of two
+
+	uint64_t rules_len = (uint64_t)(hdr->num_rules - NUM_STATIC_RULES) * sizeof(rule_t);
+	uint64_t trie_len  = (uint64_t)hdr->trie_size * sizeof(trie_node_t);
+	uint64_t edges_len = (uint64_t)hdr->num_edges * sizeof(uint32_t);
+	uint64_t slots_len = (uint64_t)hdr->num_slots * sizeof(uint32_t);
+	return hdr->rules_off % SHARED_ALIGN == 0 && hdr->rules_off + rules_len <= hdr->pool_off
+	    && hdr->pool_off % SHARED_ALIGN == 0 && hdr->pool_off + hdr->pool_size <= hdr->trie_off
+	    && hdr->trie_off % SHARED_ALIGN == 0 && hdr->trie_off + trie_len <= hdr->edges_off
+	    && hdr->edges_off % SHARED_ALIGN == 0 && hdr->edges_off + edges_len <= hdr->slots_off
+	    && hdr->slots_off % SHARED_ALIGN == 0 && hdr->slots_off + slots_len <= size;
+}
+
+// Checks every index and offset in the sections of a valid header, so a
+// corrupt file can't make lookups read outside of it or loop forever
+static bool valid_sections(const struct shared_header *hdr, const char *base)
 {
-	rule_t *cur = dynamic_rules;
-	while (cur) {
-		rule_t *next = cur->next;
-		free((char*)cur->symbol);
-		free(cur);
-		cur = next;
+	const char *pool = base + hdr->pool_off;
+	if (hdr->pool_size && pool[hdr->pool_size - 1] != '\0')
+		return false; // every string in the pool ends in it
+
+	const rule_t *rules = (const rule_t*)(base + hdr->rules_off);
+	for (uint32_t i=0; i < hdr->num_rules - NUM_STATIC_RULES; ++i) {
+		if (rules[i].flags & RULE_POOLED) {
+			if (rules[i].sym.pool_offset >= hdr->pool_size)
+				return false;
+		}
+		else if (!memchr(rules[i].sym.inline_sym, '\0', SYM_INLINE)) {
+			return false;
+		}
+	}
+
+	// children are added after their parent
+	const trie_node_t *trie = (const trie_node_t*)(base + hdr->trie_off);
+	for (uint32_t i=TRIE_ROOT; i < hdr->trie_size; ++i) {
+		if (i > TRIE_ROOT ? trie[i].parent < TRIE_ROOT || trie[i].parent >= i : trie[i].parent != NO_NODE)
+			return false;
+		if (trie[i].rule != NO_RULE && trie[i].rule >= hdr->num_rules)
+			return false;
+	}
+
+	// lookups of children stop at the first empty edge
+	const uint32_t *edges = (const uint32_t*)(base + hdr->edges_off);
+	uint32_t used = 0;
+	for (uint32_t i=0; i < hdr->num_edges; ++i) {
+		if (!edges[i])
+			continue;
+		if (edges[i] <= TRIE_ROOT || edges[i] >= hdr->trie_size)
+			return false;
+		used++;
 	}
-	dynamic_rules = NULL;
+	if (used == hdr->num_edges)
+		return false;
+
+	// lookups stop at the first empty slot
+	const uint32_t *slots = (const uint32_t*)(base + hdr->slots_off);
+	used = 0;
+	for (uint32_t i=0; i < hdr->num_slots; ++i) {
+		if (!slots[i])
+			continue;
+		if (slots[i] <= NUM_STATIC_RULES || slots[i] > hdr->num_rules)
+			return false;
+		used++;
+	}
+	return !hdr->num_slots || used < hdr->num_slots;
 }
+#endif
 
-static void free_prefixes(void)
+static bool attach_rules(const char *path)
 {
-	prefix_t *pref = prefixes;
-	while (pref) {
-		prefix_t *next = pref->next;
-		free(pref);
-		pref = next;
+#ifdef HAS_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ERROR(UL_ERR_IO, "Failed to open file '%s'", path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shared_header)) {
+		close(fd);
+		ERROR(UL_ERR_IO, "'%s' is no published rule set", path);
+		return false;
 	}
-	prefixes = NULL;
+	size_t size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ERROR(UL_ERR_IO, "Failed to map file '%s'", path);
+		return false;
+	}
+
+	const struct shared_header *hdr = map;
+	if (!valid_header(hdr, size) || !valid_sections(hdr, map)) {
+		munmap(map, size);
+		ERROR(UL_ERR_IO, "'%s' is no published rule set of this build", path);
+		return false;
+	}
+
+	const char *base = map;
+	rs->map       = map;
+	rs->map_size  = size;
+	rs->rules     = (rule_t*)(base + hdr->rules_off);
+	rs->num_rules = hdr->num_rules;
+	rs->pool      = (char*)(base + hdr->pool_off);
+	rs->pool_size = hdr->pool_size;
+	rs->trie      = (trie_node_t*)(base + hdr->trie_off);
+	rs->trie_size = hdr->trie_size;
+	rs->edges     = (uint32_t*)(base + hdr->edges_off);
+	rs->num_edges = hdr->num_edges;
+	rs->slots     = hdr->num_slots ? (uint32_t*)(base + hdr->slots_off) : NULL;
+	rs->num_slots = hdr->num_slots;
+	rules_changed();
+
+	debug("Attached %u rules from '%s'", rs->num_rules, path);
+	return true;
+#else
+	(void)path;
+	ERROR(UL_ERR_IO, "Attaching rules is not supported on this platform");
+	return false;
+#endif
 }
 
-UL_API bool ul_reset_rules(void)
+UL_API bool ul_parse(const char *str, unit_t *unit)
+{
+	TRACEPOINT1(parse__begin, str);
+	LATENCY_BEGIN(start);
+	bool pinned = pin_current();
+	bool res = parse(str, unit);
+	unpin_current(pinned);
+	LATENCY_END(start, UL_LAT_PARSE);
+	TRACEPOINT2(parse__end, str, res);
+	return res;
+}
+
+UL_API bool ul_parse_rule(const char *rule)
+{
+	LATENCY_BEGIN(start);
+	struct ul_ruleset *saved = begin_write(NULL);
+	bool res = parse_rule(rule);
+	end_write(saved);
+	LATENCY_END(start, UL_LAT_PARSE_RULE);
+	return res;
+}
+
+UL_API bool ul_load_rules(const char *path)
+{
+	TRACEPOINT1(load__begin, path);
+	LATENCY_BEGIN(start);
+	struct ul_ruleset *saved = begin_write(NULL);
+	bool res = load_rules(path);
+	end_write(saved);
+	LATENCY_END(start, UL_LAT_LOAD_RULES);
+	TRACEPOINT2(load__end, path, res);
+	return res;
+}
+
+UL_API bool ul_load_rules_parallel(const char *path, unsigned threads)
+{
+	if (!path) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+	TRACEPOINT1(load__begin, path);
+	LATENCY_BEGIN(start);
+	struct ul_ruleset *saved = begin_write(NULL);
+	bool res = load_rules_parallel(path, threads);
+	end_write(saved);
+	LATENCY_END(start, UL_LAT_LOAD_RULES);
+	TRACEPOINT2(load__end, path, res);
+	return res;
+}
+
+UL_API bool ul_publish_rules(const char *path)
+{
+	if (!path) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+	bool pinned = pin_current();
+	bool res = publish_rules(path);
+	unpin_current(pinned);
+	return res;
+}
+
+UL_API bool ul_attach_rules(const char *path)
+{
+	if (!path) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+	// threads may read the current set, so the rules go into a new one
+	struct ul_ruleset *set = new_set();
+	if (!set)
+		return false;
+	struct ul_ruleset *saved = rs;
+	rs = set;
+	bool res = attach_rules(path);
+	rs = saved;
+	if (res)
+		ul_ruleset_swap(set);
+	release_set(set);
+	return res;
+}
+
+// Returns the first living rule of rules[0..num) with the exponents of unit
+static const rule_t *find_exps(const rule_t *rules, uint32_t num, const unit_t *unit)
+{
+	for (uint32_t i=0; i < num; ++i) {
+		const rule_t *cur = &rules[i];
+		if (cur->flags & RULE_DEAD)
+			continue;
+		int j = 0;
+		while (j < NUM_BASE_UNITS && cur->exps[j] == unit->exps[j])
+			j++;
+		if (j == NUM_BASE_UNITS)
+			return cur;
+	}
+	return NULL;
+}
+
+UL_LINKAGE bool _ul_pin_rules(void)
+{
+	return pin_current();
+}
+
+UL_LINKAGE void _ul_unpin_rules(bool pinned)
+{
+	unpin_current(pinned);
+}
+
+UL_LINKAGE const char *_ul_reduce(const unit_t *unit)
+{
+	assert(rs);
+	STAT_INC(reduce_calls);
+	const rule_t *rule = find_exps(static_rules, NUM_STATIC_RULES, unit);
+	if (!rule && rs->num_slots)
+		rule = index_find(unit);
+	else if (!rule)
+		rule = find_exps(rs->rules, rs->num_rules - NUM_STATIC_RULES, unit);
+	if (!rule)
+		return NULL;
+	STAT_INC(reduce_hits);
+	return rule_symbol(rule);
+}
+
+// Removes all but the static rules
+static void free_rules(void)
+{
+	rs->num_rules = NUM_STATIC_RULES;
+	rs->pool_size = 0;
+	rs->deps_size = 0;
+	rs->deps_dead = 0;
+	rs->uses_size = 0;
+	rs->uses_lost = false;
+	if (rs->slots)
+		memset(rs->slots, 0, rs->num_slots * sizeof(uint32_t));
+	rs->slots_used = 0;
+	rules_changed();
+}
+
+// Starts over with only the static rules, they fit into trie_buf, so at
+// the first call this allocates nothing
+static bool init_rules(void)
 {
 	free_rules();
-	kilogram_hack();
+
+	// start with a fresh trie, the removed rules left their nodes behind
+	if (!trie_init())
+		return false;
+	for (uint32_t i=0; i < rs->num_rules; ++i) {
+		if (!trie_insert(i))
+			return false;
+	}
 	return true;
 }
 
-static bool init_prefixes(void)
+UL_API bool ul_reset_rules(void)
 {
-	debug("Initializing prefixes");
-	if (!add_prefix('Y', 1e24))  return false;
-	if (!add_prefix('Z', 1e21))  return false; // zetta
-	if (!add_prefix('E', 1e18))  return false; // exa
-	if (!add_prefix('P', 1e15))  return false; // peta
-	if (!add_prefix('T', 1e12))  return false; // tera
-	if (!add_prefix('G', 1e9))   return false; // giga
-	if (!add_prefix('M', 1e6))   return false; // mega
-	if (!add_prefix('k', 1e3))   return false; // kilo
-	if (!add_prefix('h', 1e2))   return false; // hecto
-	// missing: da - deca
-	if (!add_prefix('d', 1e-1))  return false; // deci
-	if (!add_prefix('c', 1e-2))  return false; // centi
-	if (!add_prefix('m', 1e-3))  return false; // milli
-	if (!add_prefix('u', 1e-6))  return false; // micro
-	if (!add_prefix('n', 1e-9))  return false; // nano
-	if (!add_prefix('p', 1e-12)) return false; // pico
-	if (!add_prefix('f', 1e-15)) return false; // femto
-	if (!add_prefix('a', 1e-18)) return false; // atto
-	if (!add_prefix('z', 1e-21)) return false; // zepto
-	if (!add_prefix('y', 1e-24)) return false; // yocto
-
-	debug("Prefixes initialized!");
+	// threads may read the current set, so a new one replaces it
+	struct ul_ruleset *set = ul_ruleset_new();
+	if (!set)
+		return false;
+	ul_ruleset_swap(set);
+	release_set(set);
 	return true;
 }
 
-UL_LINKAGE bool _ul_init_parser(void)
+UL_API ul_ruleset_t *ul_ruleset_new(void)
 {
-	debug("Initializing parser");
-	for (int i=0; i < NUM_BASE_UNITS; ++i) {
-		debug("Base rule: %d", i);
-		base_rules[i].symbol = _ul_symbols[i];
+	struct ul_ruleset *set = new_set();
+	if (!set)
+		return NULL;
+
+	struct ul_ruleset *saved = rs;
+	rs = set;
+	bool ok = init_rules();
+	rs = saved;
+	if (!ok) {
+		release_set(set);
+		return NULL;
+	}
+	return set;
+}
+
+UL_API ul_ruleset_t *ul_ruleset_current(void)
+{
+	return acquire_current();
+}
 
-		init_unit(&base_rules[i].unit);
-		base_rules[i].force = true;
-		base_rules[i].unit.exps[i] = 1;
+UL_API void ul_ruleset_free(ul_ruleset_t *set)
+{
+	if (set)
+		release_set(set);
+}
 
-		base_rules[i].next = &base_rules[i+1];
+UL_API bool ul_ruleset_parse_rule(ul_ruleset_t *set, const char *rule)
+{
+	if (!set) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
 	}
-	dynamic_rules = NULL;
-	rules = base_rules;
-	debug("Base rules initialized");
+	struct ul_ruleset *saved = begin_write(set);
+	bool res = parse_rule(rule);
+	end_write(saved);
+	return res;
+}
 
-	if (!kilogram_hack())
+UL_API bool ul_ruleset_load_rules(ul_ruleset_t *set, const char *path)
+{
+	if (!set || !path) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
 		return false;
+	}
+	struct ul_ruleset *saved = begin_write(set);
+	bool res = load_rules(path);
+	end_write(saved);
+	return res;
+}
 
-	if (!init_prefixes())
+UL_API bool ul_ruleset_swap(ul_ruleset_t *set)
+{
+	if (!set) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return false;
+	}
+	ATOMIC_INC(set->refs);
+
+	LOCK(current_lock);
+	struct ul_ruleset *old = current;
+	STORE_SEQ(current, set);
+	_ul_rules_gen = set->gen;
+	UNLOCK(current_lock);
+
+	// calls that pinned the old set finish with it, see release_set
+	release_set(old);
+	debug("Swapped in a rule set of %u rules", set->num_rules);
+	return true;
+}
+
+UL_LINKAGE bool _ul_init_parser(void)
+{
+	debug("Initializing parser");
+	for (int i=0; i < NUM_BASE_UNITS; ++i)
+		assert(strcmp(static_rules[i].sym.inline_sym, _ul_symbols[i]) == 0);
+
+	current = &main_set;
+	main_set.refs = 1;
+
+	rs = &main_set;
+	bool ok = init_rules();
+	rs = NULL;
+	if (!ok)
 		return false;
 
 	debug("Parser initalized!");
 	return true;
 }
 
+UL_LINKAGE void _ul_rules_memory(ul_memory_t *mem)
+{
+	bool pinned = pin_current();
+	mem->rules    += sizeof(static_rules) + rs->rules_cap * (sizeof(rule_t) + sizeof(rule_src_t))
+	               + rs->deps_cap * sizeof(uint32_t) + rs->uses_cap * sizeof(rule_use_t);
+	mem->symbols  += rs->pool_cap;
+	mem->prefixes += sizeof(prefixes);
+	mem->index    += rs->trie_cap * sizeof(trie_node_t);
+	if (!rs->map)
+		mem->index += (rs->num_edges + rs->num_slots) * sizeof(uint32_t);
+	unpin_current(pinned);
+}
+
 UL_LINKAGE void _ul_free_rules(void)
 {
-	free_rules();
-	free_prefixes();
+	// handles from ul_ruleset_current or ul_ruleset_new stay valid until freed
+	if (current != &main_set)
+		release_set(current);
+	current = &main_set;
+	main_set.refs = 0;
+	reclaim(true);
+
+	rs = &main_set;
+	release_rules();
+	rs = NULL;
 }
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "unitlib.h"
+
+enum {
+	NUM_FIELDS       = sizeof(ul_stats_t) / sizeof(unsigned long),
+	NUM_CACHE_FIELDS = sizeof(ul_cache_stats_t) / sizeof(unsigned long),
+};
+static_assert(sizeof(ul_stats_t) == NUM_FIELDS * sizeof(unsigned long));
+static_assert(sizeof(ul_cache_stats_t) == NUM_CACHE_FIELDS * sizeof(unsigned long));
+static_assert(NUM_CACHE_FIELDS <= NUM_FIELDS);
+
+#ifdef __GNUC__
+#define LOAD_ACQUIRE(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define LOAD_SEQ(x)         __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define CAS(x, old, new)    __sync_bool_compare_and_swap(&(x), old, new)
+#else
+#define LOAD_SEQ(x)         (x)
+#define LOAD_ACQUIRE(x)     (x)
+#define STORE_RELEASE(x, v) ((x) = (v))
+#define CAS(x, old, new)    ((x) == (old) ? ((x) = (new), true) : false)
+#endif
+
+// Every thread counts into its own block, so counting needs neither locks
+// nor atomics. ul_quit frees the blocks and starts a new generation, so the
+// threads register new ones. Threads that end release their block, it
+// keeps its counts and the next thread that registers continues it. The
+// block also holds the rule set the thread reads, see pin_current.
+struct block
+{
+	ul_stats_t       stats; // first, see _ul_release_stats
+	ul_cache_stats_t cache; // but flushes, see _ul_cache_flushes
+	const void       *pinned;
+	int              used;  // by a thread
+	struct block     *next;
+};
+
+UL_THREAD_LOCAL ul_stats_t *_ul_local_stats = NULL;
+UL_THREAD_LOCAL ul_cache_stats_t *_ul_local_cache_stats = NULL;
+UL_THREAD_LOCAL unsigned _ul_local_stats_gen = 0;
+UL_THREAD_LOCAL const void **_ul_local_pin = NULL;
+unsigned _ul_stats_gen = 1;
+
+// The rules change in ul_init already, and that must not allocate a block
+unsigned long _ul_cache_flushes = 0;
+
+static struct block *blocks = NULL;
+
+// Used if a block can't be allocated, these counts get lost
+static struct block dummy;
+
+// Counts at the last reset
+static ul_stats_t base;
+static ul_cache_stats_t cache_base;
+static unsigned long flushes_base;
+
+static ul_stats_t *use_block(struct block *b)
+{
+	_ul_local_stats = &b->stats;
+	_ul_local_cache_stats = &b->cache;
+	_ul_local_pin = b != &dummy ? &b->pinned : NULL;
+	return _ul_local_stats;
+}
+
+UL_LINKAGE ul_stats_t *_ul_register_stats(void)
+{
+	_ul_local_stats_gen = _ul_stats_gen;
+	for (struct block *b = LOAD_ACQUIRE(blocks); b; b = b->next) {
+		if (!LOAD_ACQUIRE(b->used) && CAS(b->used, 0, 1))
+			return use_block(b);
+	}
+
+	struct block *b = _ul_calloc(1, sizeof(*b));
+	if (!b)
+		return use_block(&dummy);
+	b->used = 1;
+	do {
+		b->next = LOAD_ACQUIRE(blocks);
+	} while (!CAS(blocks, b->next, b));
+	return use_block(b);
+}
+
+UL_LINKAGE void _ul_release_stats(void)
+{
+	if (_ul_local_stats_gen != _ul_stats_gen)
+		return; // nothing registered since ul_quit
+	struct block *b = (struct block *)_ul_local_stats;
+	if (b != &dummy)
+		STORE_RELEASE(b->used, 0);
+	_ul_local_stats_gen = 0;
+}
+
+UL_LINKAGE void _ul_add_stats(const ul_stats_t *stats, const ul_cache_stats_t *cache)
+{
+	unsigned long *to = (unsigned long *)local_stats();
+	const unsigned long *from = (const unsigned long *)stats;
+	for (size_t i=0; i < NUM_FIELDS; ++i)
+		to[i] += from[i];
+
+	to = (unsigned long *)_ul_local_cache_stats;
+	from = (const unsigned long *)cache;
+	for (size_t i=0; i < NUM_CACHE_FIELDS; ++i)
+		to[i] += from[i];
+}
+
+UL_LINKAGE bool _ul_rules_pinned(const void *set)
+{
+	for (struct block *b = LOAD_ACQUIRE(blocks); b; b = b->next) {
+		if (LOAD_SEQ(b->pinned) == set)
+			return true;
+	}
+	return false;
+}
+
+UL_LINKAGE void _ul_free_stats(void)
+{
+	struct block *b = blocks;
+	while (b) {
+		struct block *next = b->next;
+		_ul_free(b);
+		b = next;
+	}
+	blocks = NULL;
+	memset(&base, 0, sizeof(base));
+	memset(&cache_base, 0, sizeof(cache_base));
+	flushes_base = _ul_cache_flushes;
+	if (++_ul_stats_gen == 0)
+		_ul_stats_gen = 1;
+}
+
+UL_LINKAGE void _ul_stats_memory(ul_memory_t *mem)
+{
+	for (struct block *b = blocks; b; b = b->next)
+		mem->other += sizeof(*b);
+}
+
+// Stores the sums of num counters at offset in all blocks in out, less the
+// ones in old. With reset the sums become the new old ones.
+static void sum_counters(size_t offset, size_t num, unsigned long *out, unsigned long *old, bool reset)
+{
+	// Other threads may count while we read, the sums are a snapshot only
+	unsigned long sum[NUM_FIELDS] = { 0 };
+	for (struct block *b = LOAD_ACQUIRE(blocks); b; b = b->next) {
+		const volatile unsigned long *f = (const volatile unsigned long *)((const char *)b + offset);
+		for (size_t i=0; i < num; ++i)
+			sum[i] += f[i];
+	}
+
+	for (size_t i=0; i < num; ++i)
+		out[i] = sum[i] - old[i];
+
+	if (reset)
+		memcpy(old, sum, num * sizeof(*old));
+}
+
+UL_API void ul_stats(ul_stats_t *out, bool reset)
+{
+	if (!out) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return;
+	}
+	sum_counters(offsetof(struct block, stats), NUM_FIELDS, (unsigned long *)out,
+	             (unsigned long *)&base, reset);
+}
+
+UL_API void ul_cache_stats(ul_cache_stats_t *out, bool reset)
+{
+	if (!out) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return;
+	}
+	sum_counters(offsetof(struct block, cache), NUM_CACHE_FIELDS, (unsigned long *)out,
+	             (unsigned long *)&cache_base, reset);
+
+	// the blocks count no flushes
+	unsigned long flushes = LOAD_ACQUIRE(_ul_cache_flushes);
+	out->flushes = flushes - flushes_base;
+	if (reset)
+		flushes_base = flushes;
+}
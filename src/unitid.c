@@ -0,0 +1,254 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "unitlib.h"
+
+enum {
+	CHUNK_SIZE = 256, // Entries per chunk, chunks never move
+	MIN_SLOTS  = 64,  // Initial size of the hash table
+};
+
+// An interned unit
+struct entry
+{
+	unit_t   unit;
+	uint32_t hash;
+
+	// Everything below depends on the rules and is valid for gen only
+	unsigned   gen;
+	bool       reduced; // symbol has been looked up
+	char       *symbol;  // a copy, the rule set it came from may go away
+	char       *strings[UL_NUM_FORMATS][2]; // [format][reduce]
+};
+
+// Entry of id is chunks[(id-1) / CHUNK_SIZE][(id-1) % CHUNK_SIZE]
+static struct entry **chunks = NULL;
+static size_t num_chunks = 0;
+static uint32_t num_units = 0;
+
+// Open addressing hash table of ids, 0 marks empty slots
+static uint32_t *slots = NULL;
+static size_t num_slots = 0;
+
+static inline struct entry *get_entry(ul_unit_id id)
+{
+	return &chunks[(id - 1) / CHUNK_SIZE][(id - 1) % CHUNK_SIZE];
+}
+
+static uint32_t hash_unit(const unit_t *unit)
+{
+	// hash the double value, so long doubles with garbage padding and -0.0
+	// end up like their equal counterparts
+	double d = (double)unit->factor;
+	if (d == 0.0)
+		d = 0.0;
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+
+	uint32_t h = 2166136261u;
+	for (int i=0; i < NUM_BASE_UNITS; ++i)
+		h = (h ^ (uint32_t)unit->exps[i]) * 16777619u;
+	h = (h ^ (uint32_t)bits) * 16777619u;
+	h = (h ^ (uint32_t)(bits >> 32)) * 16777619u;
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	h = (h ^ (uint32_t)unit->scale) * 16777619u;
+#endif
+	return h;
+}
+
+static bool same_unit(const unit_t *a, const unit_t *b)
+{
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	if (a->scale != b->scale)
+		return false;
+#endif
+	// NaN factors are the same too, or every NaN unit gets a new id
+	bool same_factor = a->factor == b->factor || (a->factor != a->factor && b->factor != b->factor);
+	return same_factor && memcmp(a->exps, b->exps, EXPS_SIZE(a)) == 0;
+}
+
+static bool grow_slots(void)
+{
+	size_t size = num_slots ? 2 * num_slots : MIN_SLOTS;
+	uint32_t *s = _ul_calloc(size, sizeof(*s));
+	if (!s) {
+		ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+		return false;
+	}
+	for (uint32_t id = 1; id <= num_units; ++id) {
+		size_t i = get_entry(id)->hash & (size - 1);
+		while (s[i])
+			i = (i + 1) & (size - 1);
+		s[i] = id;
+	}
+	_ul_free(slots);
+	slots = s;
+	num_slots = size;
+	return true;
+}
+
+static struct entry *new_entry(void)
+{
+	if (num_units % CHUNK_SIZE == 0) {
+		size_t n = num_units / CHUNK_SIZE;
+		if (n >= num_chunks) {
+			size_t cnt = num_chunks ? 2 * num_chunks : 4;
+			struct entry **c = _ul_realloc(chunks, cnt * sizeof(*c));
+			if (!c) {
+				ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+				return NULL;
+			}
+			chunks = c;
+			num_chunks = cnt;
+		}
+		chunks[n] = _ul_malloc(CHUNK_SIZE * sizeof(struct entry));
+		if (!chunks[n]) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return NULL;
+		}
+	}
+	return get_entry(++num_units);
+}
+
+// Drops everything that depends on the rules, if they changed since
+static void refresh_entry(struct entry *e)
+{
+	if (e->gen == _ul_rules_gen)
+		return;
+	for (int f=0; f < UL_NUM_FORMATS; ++f) {
+		for (int r=0; r < 2; ++r) {
+			_ul_free(e->strings[f][r]);
+			e->strings[f][r] = NULL;
+		}
+	}
+	_ul_free(e->symbol);
+	e->reduced = false;
+	e->symbol = NULL;
+	e->gen = _ul_rules_gen;
+}
+
+UL_API ul_unit_id ul_intern(const unit_t *unit)
+{
+	if (!unit) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return UL_NO_UNIT;
+	}
+
+	// keep the load factor below 1/2
+	if (2 * (num_units + 1) > num_slots && !grow_slots())
+		return UL_NO_UNIT;
+
+	uint32_t h = hash_unit(unit);
+	size_t i = h & (num_slots - 1);
+	for (; slots[i]; i = (i + 1) & (num_slots - 1)) {
+		struct entry *e = get_entry(slots[i]);
+		if (e->hash == h && same_unit(&e->unit, unit))
+			return slots[i];
+	}
+
+	struct entry *e = new_entry();
+	if (!e)
+		return UL_NO_UNIT;
+	memset(e, 0, sizeof(*e));
+	copy_unit(unit, &e->unit);
+	e->hash = h;
+	e->gen = _ul_rules_gen;
+
+	slots[i] = num_units;
+	return num_units;
+}
+
+UL_API const unit_t *ul_unit(ul_unit_id id)
+{
+	if (id == UL_NO_UNIT || id > num_units) {
+		ERROR(UL_ERR_PARAM, "Invalid unit id: %u", (unsigned)id);
+		return NULL;
+	}
+	return &get_entry(id)->unit;
+}
+
+UL_API const char *ul_unit_symbol(ul_unit_id id)
+{
+	if (id == UL_NO_UNIT || id > num_units) {
+		ERROR(UL_ERR_PARAM, "Invalid unit id: %u", (unsigned)id);
+		return NULL;
+	}
+	struct entry *e = get_entry(id);
+	refresh_entry(e);
+	if (!e->reduced) {
+		bool pinned = _ul_pin_rules();
+		const char *symbol = _ul_reduce(&e->unit);
+		e->symbol = symbol ? _ul_strdup(symbol) : NULL;
+		_ul_unpin_rules(pinned);
+		if (symbol && !e->symbol) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return NULL;
+		}
+		e->reduced = true;
+	}
+	return e->symbol;
+}
+
+UL_API const char *ul_unit_string(ul_unit_id id, ul_format_t format, int fops)
+{
+	if (id == UL_NO_UNIT || id > num_units || format >= UL_NUM_FORMATS) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return NULL;
+	}
+	struct entry *e = get_entry(id);
+	refresh_entry(e);
+
+	int r = (fops & UL_FOP_REDUCE) ? 1 : 0;
+	if (!e->strings[format][r]) {
+		size_t len = ul_length(&e->unit, format, fops);
+		char *str = _ul_malloc(len + 1);
+		if (!str) {
+			ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+			return NULL;
+		}
+		if (!ul_snprint(str, len + 1, &e->unit, format, fops)) {
+			_ul_free(str);
+			return NULL;
+		}
+		e->strings[format][r] = str;
+	}
+	return e->strings[format][r];
+}
+
+UL_LINKAGE void _ul_units_memory(ul_memory_t *mem)
+{
+	size_t used_chunks = (num_units + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	mem->units += used_chunks * CHUNK_SIZE * sizeof(struct entry);
+	mem->units += num_chunks * sizeof(*chunks);
+	mem->units += num_slots * sizeof(*slots);
+	for (uint32_t id = 1; id <= num_units; ++id) {
+		struct entry *e = get_entry(id);
+		for (int f=0; f < UL_NUM_FORMATS; ++f) {
+			for (int r=0; r < 2; ++r) {
+				if (e->strings[f][r])
+					mem->units += strlen(e->strings[f][r]) + 1;
+			}
+		}
+		if (e->symbol)
+			mem->units += strlen(e->symbol) + 1;
+	}
+}
+
+UL_LINKAGE void _ul_free_units(void)
+{
+	for (uint32_t id = 1; id <= num_units; ++id) {
+		struct entry *e = get_entry(id);
+		e->gen = 0;
+		refresh_entry(e);
+	}
+	for (size_t i=0; i < num_chunks && i * CHUNK_SIZE < num_units; ++i)
+		_ul_free(chunks[i]);
+	_ul_free(chunks);
+	_ul_free(slots);
+	chunks = NULL;
+	slots = NULL;
+	num_chunks = num_slots = 0;
+	num_units = 0;
+}
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200112L
 #include <assert.h>
 #include <ctype.h>
 #include <stdarg.h>
@@ -8,18 +9,119 @@
 #include "intern.h"
 #include "unitlib.h"
 
-#define static_assert(e) extern char (*STATIC_ASSERT(void))[sizeof(char[1 - 2*!(e)])]
-#define sizeofarray(ar) (sizeof((ar))/sizeof((ar)[0]))
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(UL_NO_THREADS)
+#include <pthread.h>
+#define HAS_THREADS
+#endif
 
 static FILE *dbg_out = NULL;
 bool _ul_debugging = false;
+bool _ul_initialized = false;
+unsigned char _ul_debuglevels[UL_NUM_DBGCATS];
+
+// Ring buffer of debug messages, see ul_debugbuffer
+static char *ring = NULL;
+static size_t ring_size = 0;
+static size_t ring_head = 0; // where the next message goes
+static size_t ring_len  = 0; // bytes in use, ending at ring_head
+static bool ring_keep_last = false;
+static bool ring_used = false; // read without the lock, ring may be NULL anyway
+
+// Guards the ring, the rule loader writes from several threads
+#ifdef HAS_THREADS
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+#define RING_LOCK()   pthread_mutex_lock(&ring_lock)
+#define RING_UNLOCK() pthread_mutex_unlock(&ring_lock)
+#else
+#define RING_LOCK()   ((void)0)
+#define RING_UNLOCK() ((void)0)
+#endif
+
+#ifdef __GNUC__
+#define LOAD_RELAXED(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE_RELAXED(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#else
+#define LOAD_RELAXED(x)     (x)
+#define STORE_RELAXED(x, v) ((x) = (v))
+#endif
+
+static void ring_write(void)
+{
+	size_t tail = (ring_head + ring_size - ring_len) % ring_size;
+	if (tail + ring_len > ring_size) {
+		fwrite(ring + tail, 1, ring_size - tail, dbg_out);
+		fwrite(ring, 1, ring_len - (ring_size - tail), dbg_out);
+	}
+	else {
+		fwrite(ring + tail, 1, ring_len, dbg_out);
+	}
+	fflush(dbg_out);
+	ring_len = 0;
+}
+
+// Drops the oldest messages until n more bytes fit, every message ends
+// with a '\n'
+static void ring_drop(size_t n)
+{
+	size_t drop = ring_len + n - ring_size;
+	size_t tail = (ring_head + ring_size - ring_len) % ring_size;
+	// only whole messages
+	while (drop < ring_len && ring[(tail + drop - 1) % ring_size] != '\n')
+		drop++;
+	ring_len -= drop;
+}
+
+// Messages are never larger than the ring
+static void ring_put(const char *msg, size_t n)
+{
+	assert(n <= ring_size);
+	if (ring_len + n > ring_size) {
+		if (ring_keep_last)
+			ring_drop(n);
+		else
+			ring_write();
+	}
+
+	size_t first = ring_size - ring_head;
+	if (first > n)
+		first = n;
+	memcpy(ring + ring_head, msg, first);
+	memcpy(ring, msg + first, n - first);
+	ring_head = (ring_head + n) % ring_size;
+	ring_len += n;
+}
+
 UL_LINKAGE void _ul_debug(const char *fmt, ...)
 {
 	assert(dbg_out);
 	va_list ap;
 	va_start(ap, fmt);
-	vfprintf(dbg_out, fmt, ap);
+	if (!LOAD_RELAXED(ring_used)) {
+		// the FILE locks itself
+		vfprintf(dbg_out, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	char msg[1024];
+	int n = vsnprintf(msg, sizeof(msg), fmt, ap);
 	va_end(ap);
+	RING_LOCK();
+	if (!ring) {
+		RING_UNLOCK();
+		if (n > 0)
+			fputs(msg, dbg_out);
+		return;
+	}
+	// cut to the buffer and the ring, but still a whole line
+	size_t max = ring_size < sizeof(msg) - 1 ? ring_size : sizeof(msg) - 1;
+	if (n > (int)max) {
+		n = max;
+		msg[n - 1] = '\n';
+	}
+	if (n > 0)
+		ring_put(msg, n);
+	RING_UNLOCK();
 }
 
 const char *_ul_symbols[] = {
@@ -27,10 +129,12 @@ const char *_ul_symbols[] = {
 };
 static_assert(sizeofarray(_ul_symbols) == NUM_BASE_UNITS);
 
-// The last error message
-static char errmsg[1024];
-UL_LINKAGE void _ul_set_error(const char *func, int line, const char *fmt, ...)
+// The last error message of the calling thread
+static UL_THREAD_LOCAL char errmsg[1024];
+UL_LINKAGE void _ul_set_error(ul_errkind_t kind, const char *func, int line, const char *fmt, ...)
 {
+	STAT_INC(errors[kind]);
+
 	size_t len = 0;
 	if (_ul_debugging) {
 		snprintf(errmsg, 1024, "[%s:%d] ", func, line);
@@ -41,12 +145,49 @@ UL_LINKAGE void _ul_set_error(const char *func, int line, const char *fmt, ...)
 	va_start(ap, fmt);
 	vsnprintf(errmsg + len, 1024 - len, fmt, ap);
 	va_end(ap);
+	TRACEPOINT2(error, kind, errmsg);
+}
+
+// Sets "msg'str'after" as error message, but without the cost of vsnprintf
+UL_LINKAGE void _ul_set_error_quoted(ul_errkind_t kind, const char *func, int line, const char *msg, const char *str, size_t len, const char *after)
+{
+	STAT_INC(errors[kind]);
+
+	size_t pos = 0;
+	if (_ul_debugging) {
+		snprintf(errmsg, 1024, "[%s:%d] ", func, line);
+		pos = strlen(errmsg);
+	}
+
+	// the message, the quoted symbol and after are cut in that order, the
+	// quotes and the NUL always fit
+	size_t room = sizeof(errmsg) - 3 - pos;
+	size_t mlen = strlen(msg);
+	if (mlen > room)
+		mlen = room;
+	room -= mlen;
+	if (len > room)
+		len = room;
+	room -= len;
+	size_t alen = strlen(after);
+	if (alen > room)
+		alen = room;
+	memcpy(errmsg + pos, msg, mlen);
+	pos += mlen;
+	errmsg[pos++] = '\'';
+	memcpy(errmsg + pos, str, len);
+	pos += len;
+	errmsg[pos++] = '\'';
+	memcpy(errmsg + pos, after, alen);
+	pos += alen;
+	errmsg[pos] = '\0';
+	TRACEPOINT2(error, kind, errmsg);
 }
 
 UL_API ul_cmpres_t ul_cmp(const unit_t *a, const unit_t *b)
 {
 	if (!a || !b) {
-		ERROR("Invalid parameters");
+		ERROR(UL_ERR_PARAM, "Invalid parameters");
 		return UL_ERROR;
 	}
 
@@ -57,7 +198,7 @@ UL_API ul_cmpres_t ul_cmp(const unit_t *a, const unit_t *b)
 			break;
 		}
 	}
-	if (ncmp(a->factor, b->factor) == 0) {
+	if (fcmp(a, b) == 0) {
 		res |= UL_SAME_FACTOR;
 	}
 	return res;
@@ -66,7 +207,7 @@ UL_API ul_cmpres_t ul_cmp(const unit_t *a, const unit_t *b)
 UL_API bool ul_combine(unit_t *restrict unit, const unit_t *restrict with)
 {
 	if (!unit || !with) {
-		ERROR("Invalid parameter");
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
 		return false;
 	}
 	add_unit(unit, with, 1);
@@ -76,7 +217,7 @@ UL_API bool ul_combine(unit_t *restrict unit, const unit_t *restrict with)
 UL_API bool ul_mult(unit_t *unit, ul_number factor)
 {
 	if (!unit) {
-		ERROR("Invalid parameter");
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
 		return false;
 	}
 	unit->factor *= factor;
@@ -86,7 +227,7 @@ UL_API bool ul_mult(unit_t *unit, ul_number factor)
 UL_API bool ul_copy(unit_t *restrict dst, const unit_t *restrict src)
 {
 	if (!dst || !src) {
-		ERROR("Invalid parameter");
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
 		return false;
 	}
 	copy_unit(src, dst);
@@ -96,11 +237,11 @@ UL_API bool ul_copy(unit_t *restrict dst, const unit_t *restrict src)
 UL_API bool ul_inverse(unit_t *unit)
 {
 	if (!unit) {
-		ERROR("Invalid parameter");
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
 		return false;
 	}
 	if (ncmp(unit->factor, 0.0) == 0) {
-		ERROR("Cannot inverse 0.0");
+		ERROR(UL_ERR_MATH, "Cannot inverse 0.0");
 		return false;
 	}
 
@@ -109,49 +250,124 @@ UL_API bool ul_inverse(unit_t *unit)
 	}
 
 	unit->factor = 1/unit->factor;
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	unit->scale = -unit->scale;
+#endif
 	return true;
 }
 
 UL_API bool ul_sqrt(unit_t *unit)
 {
 	if (!unit) {
-		ERROR("Invalid parameter");
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
 		return false;
 	}
 
 	for (int i=0; i < NUM_BASE_UNITS; ++i) {
 		if ((unit->exps[i] % 2) != 0) {
-			ERROR("Cannot take root of an odd exponent");
+			ERROR(UL_ERR_MATH, "Cannot take root of an odd exponent");
 			return false;
 		}
 	}
 	for (int i=0; i < NUM_BASE_UNITS; ++i) {
 		unit->exps[i] /= 2;
 	}
+#ifdef UL_HAS_DECIMAL_EXPONENT
+	if (unit->scale % 2) {
+		unit->factor *= 10;
+		unit->scale--;
+	}
+	unit->scale /= 2;
+#endif
 	unit->factor = _sqrtn(unit->factor);
 	return true;
 }
 
+#ifdef UL_HAS_DECIMAL_EXPONENT
+UL_API ul_number ul_factor(const unit_t *unit)
+{
+	if (!unit)
+		return 0.0;
+	return unit_factor(unit);
+}
+#endif
+
 UL_API bool ul_reduceable(const unit_t *unit)
 {
 	if (!unit) {
-		ERROR("Invalid parameter");
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
 		return false;
 	}
-	return _ul_reduce(unit) != NULL;
+	bool pinned = _ul_pin_rules();
+	bool res = _ul_reduce(unit) != NULL;
+	_ul_unpin_rules(pinned);
+	return res;
 }
 
 UL_API void ul_debugging(bool flag)
 {
 	_ul_debugging = flag;
+	memset(_ul_debuglevels, flag ? UL_DBG_TRACE : UL_DBG_OFF, sizeof(_ul_debuglevels));
+}
+
+UL_API void ul_debuglevel(ul_dbgcat_t cat, ul_dbglevel_t level)
+{
+	if (cat >= UL_NUM_DBGCATS)
+		return;
+	_ul_debuglevels[cat] = level;
+
+	_ul_debugging = false;
+	for (int i=0; i < UL_NUM_DBGCATS; ++i) {
+		if (_ul_debuglevels[i] != UL_DBG_OFF)
+			_ul_debugging = true;
+	}
+}
+
+UL_API bool ul_debugbuffer(size_t size, bool keep_last)
+{
+	RING_LOCK();
+	if (ring && dbg_out)
+		ring_write();
+	_ul_free(ring);
+	ring = NULL;
+	ring_size = ring_head = ring_len = 0;
+	ring_keep_last = keep_last;
+
+	if (size) {
+		ring = _ul_malloc(size);
+		if (ring)
+			ring_size = size;
+	}
+	STORE_RELAXED(ring_used, ring != NULL);
+	RING_UNLOCK();
+
+	if (size && !ring) {
+		ERROR(UL_ERR_MEMORY, "Failed to allocate memory");
+		return false;
+	}
+	return true;
+}
+
+UL_API void ul_debugflush(void)
+{
+	RING_LOCK();
+	if (ring && dbg_out)
+		ring_write();
+	else if (dbg_out)
+		fflush(dbg_out);
+	RING_UNLOCK();
 }
 
 UL_API void ul_debugout(const char *path, bool append)
 {
 	if (dbg_out && dbg_out != stderr) {
 		debug("New debug file: %s", path ? path : "stderr");
+		ul_debugflush();
 		fclose(dbg_out);
 	}
+	else if (dbg_out) {
+		ul_debugflush();
+	}
 	if (!path) {
 		dbg_out = stderr;
 	}
@@ -166,6 +382,24 @@ UL_API void ul_debugout(const char *path, bool append)
 	fprintf(dbg_out, "** unitlib - debug log **\n");
 }
 
+UL_API void ul_memory_usage(ul_memory_t *mem)
+{
+	if (!mem) {
+		ERROR(UL_ERR_PARAM, "Invalid parameter");
+		return;
+	}
+	memset(mem, 0, sizeof(*mem));
+	_ul_rules_memory(mem);
+	_ul_cache_memory(mem);
+	_ul_units_memory(mem);
+	_ul_stats_memory(mem);
+	_ul_latency_memory(mem);
+	mem->other += ring_size;
+
+	mem->total = mem->rules + mem->symbols + mem->prefixes + mem->index +
+	             mem->cache + mem->units + mem->other;
+}
+
 UL_API const char *ul_error(void)
 {
 	return errmsg;
@@ -192,13 +426,19 @@ UL_API bool ul_init(void)
 		return false;
 	}
 
+	_ul_initialized = true;
 	debug("Init done!");
 	return true;
 }
 
 UL_API void ul_quit(void)
 {
+	_ul_initialized = false;
 	_ul_free_rules();
+	_ul_free_units();
+	ul_debugbuffer(0, false);
+	_ul_free_stats();
 	if (dbg_out && dbg_out != stderr)
 		fclose(dbg_out);
+	dbg_out = NULL;
 }
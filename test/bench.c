@@ -0,0 +1,730 @@
+#define _POSIX_C_SOURCE 199309L
+#define _DEFAULT_SOURCE // syscall()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "unitlib.h"
+
+#define RULE_FILE    "etc/rules"
+#define CATALOG_FILE "test/bench-catalog.rules"
+#define FLAT_FILE    "test/bench-flat.rules"
+#define SHARED_FILE  "test/bench-catalog.bin"
+
+// Not part of the public API, but worth measuring on its own
+UL_LINKAGE bool _ul_pin_rules(void);
+UL_LINKAGE void _ul_unpin_rules(bool pinned);
+UL_LINKAGE const char *_ul_reduce(const unit_t *unit);
+
+// Realistic unit strings, mostly what our users feed into ul_parse()
+static const char *parse_corpus[] = {
+	"m",
+	"kg",
+	"N",
+	"5 kg mm / 16 ns^2",
+	"9.81 m s^-2",
+	"0.75 kN m^-1",
+	"( 0.2 N^2 ) * 0.75 m^-1",
+	"kg*m^2/(s^4 kg) sqrt(A^2 K^4)",
+	"sqrt(4 kg^2)",
+	"(m s)^2",
+	"2 Cd 7 s^-1",
+	"1e-3 mol / m^3",
+	"ps^-2 Tm",
+	"100 kPa",
+	"230 V * 16 A",
+	"4.7 uF",
+	"6.674e-11 N m^2 kg^-2",
+	"1.380649e-23 J / K",
+	"50 Hz",
+	"12 mWb / 3 ms",
+	NULL
+};
+enum { CORPUS_SIZE = sizeof(parse_corpus) / sizeof(parse_corpus[0]) - 1 };
+
+static const char *format_names[UL_NUM_FORMATS] = {
+	"plain", "latex_frac", "latex_inline",
+};
+
+static bool json = false;
+
+/*
+ * Hardware counters of the measured loops, Linux only. Every counter the
+ * kernel refuses (no PMU in VMs, perf_event_paranoid, ...) is left out.
+ */
+enum {
+	PERF_INSTRUCTIONS = 0,
+	PERF_CYCLES,
+	PERF_BRANCH_MISSES,
+	PERF_CACHE_MISSES,
+	NUM_PERF,
+};
+
+static const char *perf_names[NUM_PERF] = {
+	"instructions", "cycles", "branch_misses", "cache_misses",
+};
+
+static int perf_fds[NUM_PERF];
+static int64_t perf_counts[NUM_PERF]; // of the last perf_end, -1 if unknown
+
+#ifdef __linux__
+static void perf_init(void)
+{
+	static const uint64_t configs[NUM_PERF] = {
+		PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES,
+	};
+
+	int opened = 0;
+	int err = 0;
+	for (int i=0; i < NUM_PERF; ++i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf_fds[i] >= 0)
+			opened++;
+		else
+			err = errno;
+	}
+	if (opened < NUM_PERF)
+		fprintf(stderr, "%d of %d perf counters unavailable: %s\n", NUM_PERF - opened, NUM_PERF, strerror(err));
+}
+
+static void perf_begin(void)
+{
+	for (int i=0; i < NUM_PERF; ++i) {
+		if (perf_fds[i] >= 0) {
+			ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+static void perf_end(void)
+{
+	for (int i=0; i < NUM_PERF; ++i) {
+		perf_counts[i] = -1;
+		if (perf_fds[i] < 0)
+			continue;
+		ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		int64_t val;
+		if (read(perf_fds[i], &val, sizeof(val)) == sizeof(val))
+			perf_counts[i] = val;
+	}
+}
+
+static void perf_quit(void)
+{
+	for (int i=0; i < NUM_PERF; ++i) {
+		if (perf_fds[i] >= 0)
+			close(perf_fds[i]);
+	}
+}
+#else
+static void perf_init(void)
+{
+	for (int i=0; i < NUM_PERF; ++i)
+		perf_fds[i] = -1;
+}
+static void perf_begin(void) {}
+static void perf_end(void)
+{
+	for (int i=0; i < NUM_PERF; ++i)
+		perf_counts[i] = -1;
+}
+static void perf_quit(void) {}
+#endif
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Reports the counters of the last perf_end too, if there are any
+static void report(const char *name, long ops, double ns)
+{
+	if (json) {
+		printf("{\"bench\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, \"ops_per_s\": %.0f",
+		       name, ops, ns / ops, ops / (ns / 1e9));
+		for (int i=0; i < NUM_PERF; ++i) {
+			if (perf_counts[i] >= 0)
+				printf(", \"%s_per_op\": %.2f", perf_names[i], (double)perf_counts[i] / ops);
+		}
+		printf("}\n");
+	}
+	else {
+		printf("%-22s %10ld ops %10.1f ns/op %12.0f ops/s",
+		       name, ops, ns / ops, ops / (ns / 1e9));
+		static const char *abbrevs[NUM_PERF] = { "ins", "cyc", "br-miss", "c-miss" };
+		for (int i=0; i < NUM_PERF; ++i) {
+			if (perf_counts[i] >= 0)
+				printf(" %8.2f %s", (double)perf_counts[i] / ops, abbrevs[i]);
+		}
+		printf("\n");
+	}
+
+	for (int i=0; i < NUM_PERF; ++i)
+		perf_counts[i] = -1;
+}
+
+static int bench_parse(long rounds)
+{
+	unit_t u;
+	long ops = 0;
+
+	double start = now_ns();
+	perf_begin();
+	for (long r = 0; r < rounds; ++r) {
+		for (const char **s = parse_corpus; *s; ++s) {
+			if (!ul_parse(*s, &u)) {
+				fprintf(stderr, "Failed to parse '%s': %s\n", *s, ul_error());
+				return 1;
+			}
+			ops++;
+		}
+	}
+	perf_end();
+	report("parse", ops, now_ns() - start);
+	return 0;
+}
+
+static int bench_reduce(long rounds)
+{
+	unit_t units[CORPUS_SIZE];
+	for (int i=0; i < CORPUS_SIZE; ++i)
+		ul_parse(parse_corpus[i], &units[i]);
+
+	long ops = 0;
+	long found = 0;
+	double start = now_ns();
+	bool pinned = _ul_pin_rules();
+	perf_begin();
+	for (long r = 0; r < rounds; ++r) {
+		for (int i=0; i < CORPUS_SIZE; ++i) {
+			if (_ul_reduce(&units[i]))
+				found++;
+			ops++;
+		}
+	}
+	perf_end();
+	_ul_unpin_rules(pinned);
+	report("reduce", ops, now_ns() - start);
+	return found ? 0 : 1;
+}
+
+static int bench_print(long rounds)
+{
+	unit_t units[CORPUS_SIZE];
+	for (int i=0; i < CORPUS_SIZE; ++i)
+		ul_parse(parse_corpus[i], &units[i]);
+
+	FILE *null = fopen("/dev/null", "w");
+	if (!null) {
+		perror("Failed to open /dev/null");
+		return 1;
+	}
+
+	for (int fmt=0; fmt < UL_NUM_FORMATS; ++fmt) {
+		for (int reduce=0; reduce < 2; ++reduce) {
+			int fops = reduce ? UL_FOP_REDUCE : 0;
+			char name[64];
+			char buffer[256];
+
+			long ops = 0;
+			double start = now_ns();
+			perf_begin();
+			for (long r = 0; r < rounds; ++r) {
+				for (int i=0; i < CORPUS_SIZE; ++i, ++ops)
+					ul_snprint(buffer, sizeof(buffer), &units[i], fmt, fops);
+			}
+			perf_end();
+			snprintf(name, sizeof(name), "snprint_%s%s", format_names[fmt], reduce ? "_r" : "");
+			report(name, ops, now_ns() - start);
+
+			ops = 0;
+			start = now_ns();
+			perf_begin();
+			for (long r = 0; r < rounds; ++r) {
+				for (int i=0; i < CORPUS_SIZE; ++i, ++ops)
+					ul_fprint(null, &units[i], fmt, fops);
+			}
+			perf_end();
+			snprintf(name, sizeof(name), "fprint_%s%s", format_names[fmt], reduce ? "_r" : "");
+			report(name, ops, now_ns() - start);
+		}
+	}
+	fclose(null);
+	return 0;
+}
+
+// Reads the non-comment lines of a rule file
+static int read_rules(const char *path, char lines[][256], int max)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return 0;
+	int n = 0;
+	while (n < max && fgets(lines[n], 256, f)) {
+		if (lines[n][0] != '#' && lines[n][0] != '\n')
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+// The rules of RULE_FILE
+static char rule_lines[256][256];
+static int num_rules = 0;
+
+static int bench_parse_rule(long rounds)
+{
+	long ops = 0;
+	double time = 0.0;
+	for (long r = 0; r < rounds; ++r) {
+		ul_reset_rules();
+		double start = now_ns();
+		for (int i=0; i < num_rules; ++i, ++ops) {
+			if (!ul_parse_rule(rule_lines[i])) {
+				fprintf(stderr, "Failed to parse rule '%s': %s\n", rule_lines[i], ul_error());
+				return 1;
+			}
+		}
+		time += now_ns() - start;
+	}
+	report("parse_rule", ops, time);
+	return 0;
+}
+
+// Reports the time per loaded rule, parallel loads with one thread per CPU
+static int bench_load(const char *name, const char *path, long rules_in_file, long rounds, bool parallel)
+{
+	double time = 0.0;
+	for (long r = 0; r < rounds; ++r) {
+		ul_reset_rules();
+		double start = now_ns();
+		bool ok = parallel ? ul_load_rules_parallel(path, 0) : ul_load_rules(path);
+		if (!ok) {
+			fprintf(stderr, "Failed to load '%s': %s\n", path, ul_error());
+			return 1;
+		}
+		time += now_ns() - start;
+	}
+	report(name, rounds * rules_in_file, time);
+	return 0;
+}
+
+// Publishes the loaded rules and reports the time to attach them
+static int bench_attach(const char *name, long rounds)
+{
+	if (!ul_publish_rules(SHARED_FILE)) {
+		fprintf(stderr, "Failed to publish the rules: %s\n", ul_error());
+		return 1;
+	}
+	double time = 0.0;
+	for (long r = 0; r < rounds; ++r) {
+		double start = now_ns();
+		if (!ul_attach_rules(SHARED_FILE)) {
+			fprintf(stderr, "Failed to attach '%s': %s\n", SHARED_FILE, ul_error());
+			return 1;
+		}
+		time += now_ns() - start;
+	}
+	ul_reset_rules();
+	remove(SHARED_FILE);
+	report(name, rounds, time);
+	return 0;
+}
+
+static void catalog_symbol(char *buffer, long i)
+{
+	*buffer++ = 'Q';
+	do {
+		*buffer++ = 'a' + i % 26;
+		i /= 26;
+	} while (i);
+	*buffer = '\0';
+}
+
+// Writes n rules, each one built from two earlier ones, or with flat from
+// the base units only, so they don't depend on each other
+static bool write_catalog(const char *path, long n, bool flat)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return false;
+	for (long i=0; i < n; ++i) {
+		char sym[16], a[16], b[16];
+		catalog_symbol(sym, i);
+		if (i == 0 || flat) {
+			fprintf(f, "%s = %ld.5 kg m^2 s^-2\n", sym, i % 100 + 1);
+			continue;
+		}
+		catalog_symbol(a, i / 2);
+		catalog_symbol(b, i / 3);
+		fprintf(f, "%s = 1.5 %s %s^-1 m\n", sym, a, b);
+	}
+	return fclose(f) == 0;
+}
+
+// Reports the time to redefine rule i of the catalog, the root 0 is used by
+// all other rules, the last one by none
+static int bench_redefine(const char *name, long rounds, long i)
+{
+	char rule[64];
+	catalog_symbol(rule + 1, i);
+	rule[0] = '!';
+	strcat(rule, " = 2.5 kg m^2 s^-2");
+
+	double time = 0.0;
+	for (long r = 0; r < rounds; ++r) {
+		ul_reset_rules();
+		if (!ul_load_rules(CATALOG_FILE)) {
+			fprintf(stderr, "Failed to load '%s': %s\n", CATALOG_FILE, ul_error());
+			return 1;
+		}
+		double start = now_ns();
+		if (!ul_parse_rule(rule)) {
+			fprintf(stderr, "Failed to redefine rule %ld: %s\n", i, ul_error());
+			return 1;
+		}
+		time += now_ns() - start;
+	}
+	report(name, rounds, time);
+	return 0;
+}
+
+// Memory of catalogs of increasing size
+static int bench_memory(long max_rules)
+{
+	ul_memory_t empty, loaded;
+	for (long n = max_rules / 8; n <= max_rules; n *= 2) {
+		// start from scratch, ul_reset_rules keeps the storage for reuse
+		ul_quit();
+		if (!ul_init()) {
+			fprintf(stderr, "ul_init failed: %s\n", ul_error());
+			return 1;
+		}
+		ul_memory_usage(&empty);
+		if (!write_catalog(CATALOG_FILE, n, false) || !ul_load_rules(CATALOG_FILE)) {
+			fprintf(stderr, "Failed to load a catalog of %ld rules: %s\n", n, ul_error());
+			return 1;
+		}
+		ul_memory_usage(&loaded);
+
+		size_t bytes = loaded.total - empty.total;
+		if (json) {
+			printf("{\"bench\": \"memory\", \"rules\": %ld, \"bytes\": %zu, \"bytes_per_rule\": %.1f, "
+			       "\"rule_bytes\": %zu, \"symbol_bytes\": %zu, \"index_bytes\": %zu}\n",
+			       n, bytes, (double)bytes / n, loaded.rules - empty.rules,
+			       loaded.symbols - empty.symbols, loaded.index - empty.index);
+		}
+		else {
+			printf("%-22s %10ld rules %10zu bytes %8.1f bytes/rule (rules %zu, symbols %zu, index %zu)\n",
+			       "memory", n, bytes, (double)bytes / n, loaded.rules - empty.rules,
+			       loaded.symbols - empty.symbols, loaded.index - empty.index);
+		}
+		if (n == max_rules)
+			break;
+		if (2 * n > max_rules)
+			n = max_rules / 2;
+	}
+	return 0;
+}
+
+enum {
+	SCALE_SIZES   = 4,    // catalogs of max/8, max/4, max/2 and max rules
+	SCALE_LOOKUPS = 5000, // symbols looked up and units reduced per size
+	SCALE_TRIES   = 9,    // the median of them counts
+	SCALE_REDEFS  = 100,  // rules no other rule uses redefined per try
+};
+
+// How much slower the largest catalog may be per rule or lookup than the
+// smallest one, which has 1/8 of its rules. Its symbols are a character
+// longer and its tables outgrow the CPU caches, lookups get about 1.8 times
+// as slow with that, loading about 1.4 times.
+#define SCALE_LIMIT 2.5
+
+static int cmp_time(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double median(double times[SCALE_TRIES])
+{
+	qsort(times, SCALE_TRIES, sizeof(double), cmp_time);
+	return times[SCALE_TRIES / 2];
+}
+
+static void scale_file(char *buffer, size_t size, int s)
+{
+	snprintf(buffer, size, "%s.%d", CATALOG_FILE, s);
+}
+
+// Takes turns between the catalogs like median_lookups, the last try of
+// every size stays loaded in sets
+static bool median_loads(const long sizes[SCALE_SIZES], ul_ruleset_t *sets[SCALE_SIZES],
+                         double load[SCALE_SIZES])
+{
+	double times[SCALE_SIZES][SCALE_TRIES];
+	for (int t=0; t < SCALE_TRIES; ++t) {
+		for (int s=0; s < SCALE_SIZES; ++s) {
+			char path[FILENAME_MAX];
+			scale_file(path, sizeof(path), s);
+			ul_reset_rules();
+			double start = now_ns();
+			if (!ul_load_rules(path))
+				return false;
+			times[s][t] = now_ns() - start;
+			if (t == SCALE_TRIES - 1 && !(sets[s] = ul_ruleset_current()))
+				return false;
+		}
+	}
+	for (int s=0; s < SCALE_SIZES; ++s)
+		load[s] = median(times[s]) / sizes[s];
+	return true;
+}
+
+// Symbols spread over the catalog of every size and the units of their rules
+static char   scale_syms[SCALE_SIZES][SCALE_LOOKUPS][16];
+static unit_t scale_units[SCALE_SIZES][SCALE_LOOKUPS];
+
+static bool init_lookups(int size, long n)
+{
+	for (long i=0; i < SCALE_LOOKUPS; ++i) {
+		catalog_symbol(scale_syms[size][i], (i * 7919) % n);
+		if (!ul_parse(scale_syms[size][i], &scale_units[size][i]))
+			return false;
+	}
+	return true;
+}
+
+// Looks up the symbols of a size with the current rules, with reduce the units
+static double time_lookups(int size, bool reduce)
+{
+	bool pinned = _ul_pin_rules();
+	double start = now_ns();
+	for (long i=0; i < SCALE_LOOKUPS; ++i) {
+		unit_t *unit = &scale_units[size][i];
+		if (reduce ? !_ul_reduce(unit) : !ul_parse(scale_syms[size][i], unit)) {
+			_ul_unpin_rules(pinned);
+			return -1.0;
+		}
+	}
+	double time = now_ns() - start;
+	_ul_unpin_rules(pinned);
+	return time;
+}
+
+// Takes turns between the sets, so a busy moment of the machine slows the
+// tries of every size alike
+static bool median_lookups(ul_ruleset_t *sets[SCALE_SIZES], double lookup[SCALE_SIZES],
+                           double reduce[SCALE_SIZES])
+{
+	double times[2][SCALE_SIZES][SCALE_TRIES];
+	for (int t=0; t < SCALE_TRIES; ++t) {
+		for (int s=0; s < SCALE_SIZES; ++s) {
+			if (!ul_ruleset_swap(sets[s]))
+				return false;
+			times[0][s][t] = time_lookups(s, false);
+			times[1][s][t] = time_lookups(s, true);
+			if (times[0][s][t] < 0.0 || times[1][s][t] < 0.0)
+				return false;
+		}
+	}
+	for (int s=0; s < SCALE_SIZES; ++s) {
+		lookup[s] = median(times[0][s]) / SCALE_LOOKUPS;
+		reduce[s] = median(times[1][s]) / SCALE_LOOKUPS;
+	}
+	return true;
+}
+
+// Redefines rules from the end of the loaded catalog, no rule uses the
+// second half. Every try takes other ones, redefined rules are forced.
+static double median_redefine(long n)
+{
+	long redefs = n / (2 * SCALE_TRIES);
+	if (redefs > SCALE_REDEFS)
+		redefs = SCALE_REDEFS;
+	if (redefs < 1)
+		redefs = 1;
+
+	double times[SCALE_TRIES];
+	long i = n - 1;
+	for (int t=0; t < SCALE_TRIES; ++t) {
+		double start = now_ns();
+		for (long r=0; r < redefs; ++r, --i) {
+			char rule[64];
+			rule[0] = '!';
+			catalog_symbol(rule + 1, i);
+			strcat(rule, " = 2.5 kg m^2 s^-2");
+			if (!ul_parse_rule(rule))
+				return -1.0;
+		}
+		times[t] = now_ns() - start;
+	}
+	return median(times) / redefs;
+}
+
+static const char *scale_names[] = { "scale_load", "scale_lookup", "scale_reduce", "scale_redefine" };
+enum { NUM_SCALE = sizeof(scale_names) / sizeof(scale_names[0]) };
+
+// Measures every size, keeping the catalog of each in sets
+static bool measure_scale(long sizes[SCALE_SIZES], ul_ruleset_t *sets[SCALE_SIZES],
+                          double ns[NUM_SCALE][SCALE_SIZES])
+{
+	for (int s=0; s < SCALE_SIZES; ++s) {
+		char path[FILENAME_MAX];
+		scale_file(path, sizeof(path), s);
+		if (!write_catalog(path, sizes[s], false)) {
+			fprintf(stderr, "Failed to write '%s'\n", path);
+			return false;
+		}
+	}
+	if (!median_loads(sizes, sets, ns[0])) {
+		fprintf(stderr, "Loading failed: %s\n", ul_error());
+		return false;
+	}
+	for (int s=0; s < SCALE_SIZES; ++s) {
+		if (!ul_ruleset_swap(sets[s]) || !init_lookups(s, sizes[s])) {
+			fprintf(stderr, "Looking up failed with %ld rules: %s\n", sizes[s], ul_error());
+			return false;
+		}
+	}
+	if (!median_lookups(sets, ns[1], ns[2])) {
+		fprintf(stderr, "Lookups failed: %s\n", ul_error());
+		return false;
+	}
+	for (int s=0; s < SCALE_SIZES; ++s) {
+		if (!ul_ruleset_swap(sets[s]) || (ns[3][s] = median_redefine(sizes[s])) < 0.0) {
+			fprintf(stderr, "Redefining failed with %ld rules: %s\n", sizes[s], ul_error());
+			return false;
+		}
+	}
+	return true;
+}
+
+// Loading has to stay near linear in the size of the catalog, lookups,
+// reductions and redefinitions of unused rules sub-linear, or this fails
+static int bench_scale(long max_rules)
+{
+	long sizes[SCALE_SIZES];
+	for (int s=0; s < SCALE_SIZES; ++s)
+		sizes[s] = max_rules >> (SCALE_SIZES - 1 - s);
+
+	ul_ruleset_t *sets[SCALE_SIZES] = { NULL };
+	double ns[NUM_SCALE][SCALE_SIZES];
+	bool ok = measure_scale(sizes, sets, ns);
+	for (int s=0; s < SCALE_SIZES; ++s) {
+		char path[FILENAME_MAX];
+		scale_file(path, sizeof(path), s);
+		remove(path);
+		ul_ruleset_free(sets[s]);
+	}
+	ul_reset_rules();
+	if (!ok)
+		return 1;
+
+	for (int s=0; s < SCALE_SIZES; ++s) {
+		for (int k=0; k < NUM_SCALE; ++k) {
+			char name[64];
+			snprintf(name, sizeof(name), "%s_%ld", scale_names[k], sizes[s]);
+			long ops = k == 0 ? sizes[s] : k == 3 ? SCALE_REDEFS : SCALE_LOOKUPS;
+			report(name, ops, ns[k][s] * ops);
+		}
+	}
+
+	int res = 0;
+	for (int k=0; k < NUM_SCALE; ++k) {
+		double growth = ns[k][SCALE_SIZES - 1] / ns[k][0];
+		if (growth > SCALE_LIMIT) {
+			fprintf(stderr, "%s: %.1f times slower per op with %ld than with %ld rules\n",
+			        scale_names[k], growth, sizes[SCALE_SIZES - 1], sizes[0]);
+			res = 1;
+		}
+	}
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	long rounds = 20000;
+	long catalog = 5000;
+	long scale = 100000;
+	for (int i=1; i < argc; ++i) {
+		if (strcmp(argv[i], "-j") == 0)
+			json = true;
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			catalog = atol(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			scale = atol(argv[++i]);
+		else
+			rounds = atol(argv[i]);
+	}
+	if (rounds < 20 || catalog < 1 || scale < 8) {
+		fprintf(stderr, "Usage: %s [-j] [-c catalog size] [-s largest scale catalog] [rounds >= 20]\n", argv[0]);
+		return 1;
+	}
+
+	if (!ul_init()) {
+		fprintf(stderr, "ul_init failed: %s\n", ul_error());
+		return 1;
+	}
+	if (!ul_load_rules(RULE_FILE)) {
+		fprintf(stderr, "Failed to load '%s': %s\n", RULE_FILE, ul_error());
+		return 1;
+	}
+	num_rules = read_rules(RULE_FILE, rule_lines, 256);
+	if (!num_rules) {
+		fprintf(stderr, "No rules in '%s'\n", RULE_FILE);
+		return 1;
+	}
+	if (!write_catalog(CATALOG_FILE, catalog, false) || !write_catalog(FLAT_FILE, catalog, true)) {
+		fprintf(stderr, "Failed to write the catalogs\n");
+		return 1;
+	}
+
+	perf_init();
+	perf_end(); // no counts for benchmarks without perf_begin
+
+	int res = 0;
+	res |= bench_parse(rounds);
+	res |= bench_reduce(rounds);
+	res |= bench_print(rounds / 4);
+	res |= bench_parse_rule(rounds / 20);
+	res |= bench_load("load_rules", RULE_FILE, num_rules, rounds / 20, false);
+	res |= bench_load("load_catalog", CATALOG_FILE, catalog, 5, false);
+	res |= bench_load("load_catalog_parallel", CATALOG_FILE, catalog, 5, true);
+	res |= bench_load("load_flat", FLAT_FILE, catalog, 5, false);
+	res |= bench_load("load_flat_parallel", FLAT_FILE, catalog, 5, true);
+	res |= bench_redefine("redefine_root", 5, 0);
+	res |= bench_redefine("redefine_leaf", 5, catalog - 1);
+	res |= bench_attach("attach_catalog", rounds / 20);
+	res |= bench_memory(catalog);
+	res |= bench_scale(scale);
+
+	remove(CATALOG_FILE);
+	remove(FLAT_FILE);
+	perf_quit();
+	ul_quit();
+	return res;
+}
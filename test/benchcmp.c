@@ -0,0 +1,199 @@
+/*
+ * Compares several runs of "ulbench -j" against a baseline.
+ *
+ *   benchcmp [-t threshold] baseline.json runs.json
+ *   benchcmp -w baseline.json runs.json
+ *
+ * For every benchmark the median ns/op of all runs and a 95% confidence
+ * interval of the median (order statistics) are computed. A benchmark has
+ * regressed if even the lower end of its interval is more than threshold
+ * (relative) slower than the baseline median. -w writes the runs as the new
+ * baseline instead.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	MAX_BENCHES = 128,
+	MAX_RUNS    = 64,
+	MAX_NAME    = 64,
+};
+
+#define DEFAULT_THRESHOLD 0.25
+
+struct bench
+{
+	char   name[MAX_NAME];
+	double times[MAX_RUNS]; // ns/op of each run
+	int    runs;
+
+	double median, low, high;
+	double baseline; // median of the baseline, 0 if unknown
+};
+
+static struct bench benches[MAX_BENCHES];
+static int num_benches = 0;
+
+static struct bench *get_bench(const char *name, bool create)
+{
+	for (int i=0; i < num_benches; ++i) {
+		if (strcmp(benches[i].name, name) == 0)
+			return &benches[i];
+	}
+	if (!create || num_benches == MAX_BENCHES)
+		return NULL;
+	struct bench *b = &benches[num_benches++];
+	snprintf(b->name, MAX_NAME, "%s", name);
+	return b;
+}
+
+// Reads the output of "ulbench -j", one benchmark per line
+static bool read_runs(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		char name[MAX_NAME];
+		long ops;
+		double ns;
+		if (sscanf(line, " {\"bench\": \"%63[^\"]\", \"ops\": %ld, \"ns_per_op\": %lf", name, &ops, &ns) != 3)
+			continue;
+		struct bench *b = get_bench(name, true);
+		if (b && b->runs < MAX_RUNS)
+			b->times[b->runs++] = ns;
+	}
+	fclose(f);
+	return num_benches > 0;
+}
+
+// Reads a baseline written by -w, one benchmark per line
+static bool read_baseline(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		char name[MAX_NAME];
+		double median;
+		if (sscanf(line, " \"%63[^\"]\": {\"median\": %lf", name, &median) != 2)
+			continue;
+		struct bench *b = get_bench(name, false);
+		if (b)
+			b->baseline = median;
+	}
+	fclose(f);
+	return true;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void summarize(struct bench *b)
+{
+	int n = b->runs;
+	qsort(b->times, n, sizeof(double), cmp_double);
+	b->median = (n % 2) ? b->times[n / 2] : (b->times[n / 2 - 1] + b->times[n / 2]) / 2;
+
+	// ranks of the 95% interval, from the normal approximation of the binomial
+	int lo = (int)floor(n / 2.0 - 0.98 * sqrt(n));
+	int hi = (int)ceil(n / 2.0 + 1 + 0.98 * sqrt(n));
+	b->low  = b->times[lo < 1 ? 0 : lo - 1];
+	b->high = b->times[hi > n ? n - 1 : hi - 1];
+}
+
+static bool write_baseline(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	fprintf(f, "{");
+	for (int i=0; i < num_benches; ++i) {
+		struct bench *b = &benches[i];
+		fprintf(f, "%s\n  \"%s\": {\"median\": %.1f, \"low\": %.1f, \"high\": %.1f, \"runs\": %d}",
+		        i ? "," : "", b->name, b->median, b->low, b->high, b->runs);
+	}
+	fprintf(f, "\n}\n");
+	return fclose(f) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	double threshold = DEFAULT_THRESHOLD;
+	bool write = false;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; ++i) {
+		if (strcmp(argv[i], "-w") == 0)
+			write = true;
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else
+			break;
+	}
+	if (argc - i != 2) {
+		fprintf(stderr, "Usage: %s [-t threshold | -w] baseline.json runs.json\n", argv[0]);
+		return 2;
+	}
+	const char *baseline = argv[i];
+	const char *runs = argv[i + 1];
+
+	if (!read_runs(runs)) {
+		fprintf(stderr, "No benchmark results in '%s'\n", runs);
+		return 2;
+	}
+	for (int j=0; j < num_benches; ++j)
+		summarize(&benches[j]);
+
+	if (write) {
+		if (!write_baseline(baseline))
+			return 2;
+		printf("Wrote %d benchmarks to '%s'\n", num_benches, baseline);
+		return 0;
+	}
+	if (!read_baseline(baseline))
+		return 2;
+
+	int regressions = 0;
+	printf("%-22s %10s %10s %21s %8s\n", "benchmark", "baseline", "median", "95% interval", "change");
+	for (int j=0; j < num_benches; ++j) {
+		struct bench *b = &benches[j];
+		printf("%-22s ", b->name);
+		if (b->baseline <= 0.0) {
+			printf("%10s %10.1f [%8.1f, %8.1f]      new\n", "-", b->median, b->low, b->high);
+			continue;
+		}
+
+		const char *verdict = "";
+		if (b->low > b->baseline * (1 + threshold)) {
+			verdict = "  REGRESSION";
+			regressions++;
+		}
+		else if (b->high < b->baseline * (1 - threshold)) {
+			verdict = "  faster";
+		}
+		printf("%10.1f %10.1f [%8.1f, %8.1f] %+7.1f%%%s\n", b->baseline, b->median,
+		       b->low, b->high, 100.0 * (b->median / b->baseline - 1), verdict);
+	}
+
+	if (regressions) {
+		printf("%d of %d benchmarks regressed by more than %.0f%%\n",
+		       regressions, num_benches, 100 * threshold);
+		return 1;
+	}
+	return 0;
+}
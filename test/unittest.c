@@ -1,9 +1,14 @@
 #ifndef GET_TEST_DEFS
+#include <locale.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <float.h>
 #include <math.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define HAS_PTHREAD
+#endif
 #include "unitlib.h"
 
 // yay, self include (-:
@@ -20,13 +25,30 @@ static inline int ncmp(ul_number a, ul_number b)
 	return 1;
 }
 
+// Like ncmp, but relative to the size of b, for results of several roundings
+static inline int rcmp(ul_number a, ul_number b)
+{
+	if (_fabsn(a-b) <= 4 * N_EPSILON * _fabsn(b))
+		return 0;
+	if (a < b)
+		return -1;
+	return 1;
+}
+
+// Literals with the precision of ul_number
+#ifdef UL_HAS_LONG_DOUBLE
+#define NUM(x) x##L
+#else
+#define NUM(x) x
+#endif
+
 static unit_t make_unit(ul_number fac, ...)
 {
 	va_list args;
 	va_start(args, fac);
 
 	unit_t u;
-	memset(u.exps, 0, NUM_BASE_UNITS * sizeof(int));
+	memset(&u, 0, sizeof(u));
 	u.factor = fac;
 
 	int b = va_arg(args, int);
@@ -62,7 +84,7 @@ TEST_SUITE(parser)
 				}
 			}
 
-			CHECK(ncmp(u.factor, 1.0) == 0);
+			CHECK(ncmp(ul_factor(&u), 1.0) == 0);
 		END_TEST
 
 		TEST
@@ -73,20 +95,34 @@ TEST_SUITE(parser)
 			CHECK(u.exps[U_KILOGRAM] == 2);
 			CHECK(u.exps[U_METER] == 1);
 			CHECK(u.exps[U_SECOND] == 0);
-			CHECK(ncmp(u.factor, 1.0) == 0);
+			CHECK(ncmp(ul_factor(&u), 1.0) == 0);
 
 			CHECK(ul_parse("2 Cd 7 s^-1", &u));
 			FAIL_MSG("Error: %s", ul_error());
 			CHECK(u.exps[U_CANDELA] == 1);
 			CHECK(u.exps[U_SECOND] == -1);
-			CHECK(ncmp(u.factor, 14.0) == 0);
+			CHECK(ncmp(ul_factor(&u), 14.0) == 0);
 
 			CHECK(ul_parse("", &u));
 			int i=0;
 			for (; i < NUM_BASE_UNITS; ++i) {
 				CHECK(u.exps[i] == 0);
 			}
-			CHECK(ncmp(u.factor, 1.0) == 0);
+			CHECK(ncmp(ul_factor(&u), 1.0) == 0);
+		END_TEST
+
+		TEST
+			// items and whitespace runs longer than the tokenizer's blocks
+			CHECK(ul_parse_rule("  SomeRatherLongSymbolNameForScanning   =   kg  "));
+			FAIL_MSG("Error: %s", ul_error());
+
+			unit_t u;
+			CHECK(ul_parse("                                        m\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+			               "SomeRatherLongSymbolNameForScanning^2/(s                                  )", &u));
+			FAIL_MSG("Error: %s", ul_error());
+			CHECK(u.exps[U_METER] == 1);
+			CHECK(u.exps[U_KILOGRAM] == 2);
+			CHECK(u.exps[U_SECOND] == -1);
 		END_TEST
 	END_GROUP()
 
@@ -99,6 +135,8 @@ TEST_SUITE(parser)
 				"5! * kg^2", // !
 				"5 * kg^2!", // !
 				"sqrt kg^2)", // missing ( after sqrt
+				"sqrt 4",     // missing ( after sqrt
+				"-kg",        // neither factor nor unit
 				"( kg^2 m",   // missing )
 				"((((((((((((((((((((((((((((((((((((((((((((((((",
 				NULL
@@ -158,7 +196,7 @@ TEST_SUITE(parser)
 			for (; i < NUM_BASE_UNITS; ++i) {
 				CHECK(u.exps[i] == 0);
 			}
-			CHECK(ncmp(u.factor, 1.0) == 0);
+			CHECK(ncmp(ul_factor(&u), 1.0) == 0);
 		END_TEST
 	END_GROUP()
 
@@ -191,13 +229,79 @@ TEST_SUITE(parser)
 		CHECK(ul_parse_rule(" Recurse = m"));
 		FAIL_MSG("Error: %s", ul_error());
 		CHECK(ul_parse_rule("!Recurse = Recurse") == false);
+		CHECK(ul_parse("Recurse", &u));
+		FAIL_MSG("Error: %s", ul_error());
+	END_TEST
+
+	TEST
+		// rules that use a redefined rule are recomputed
+		unit_t u;
+		CHECK(ul_parse_rule("DepRoot = 2 kg"));
+		CHECK(ul_parse_rule("DepMid = 3 DepRoot m"));
+		CHECK(ul_parse_rule("DepLeaf = DepMid / s"));
+		CHECK(ul_parse_rule("DepKilo = kDepMid"));
+		CHECK(ul_parse_rule("kDepMid = 7 s"));
+		CHECK(ul_parse_rule("DepOther = 4 kg"));
+		CHECK(ul_parse_rule("!DepRoot = 5 s"));
+		FAIL_MSG("Error: %s", ul_error());
+
+		CHECK(ul_parse("DepLeaf", &u));
+		CHECK(ncmp(ul_factor(&u), 15.0) == 0);
+		CHECK(u.exps[U_KILOGRAM] == 0 && u.exps[U_SECOND] == 0 && u.exps[U_METER] == 1);
+		FAIL_MSG("Factor %g, kg^%d s^%d", (double)ul_factor(&u), u.exps[U_KILOGRAM], u.exps[U_SECOND]);
+
+		// still kilo DepMid, not the later kDepMid
+		CHECK(ul_parse("DepKilo", &u));
+		CHECK(ncmp(ul_factor(&u), 15000.0) == 0);
+		CHECK(u.exps[U_SECOND] == 1);
+
+		CHECK(ul_parse("DepOther", &u));
+		CHECK(ncmp(ul_factor(&u), 4.0) == 0);
+
+		// DepLeaf uses DepMid
+		CHECK(ul_parse_rule("!DepMid = 2 DepLeaf") == false);
+		CHECK(ul_parse("DepLeaf", &u));
+		CHECK(ncmp(ul_factor(&u), 15.0) == 0);
+		CHECK(ul_parse("DepMid", &u));
+		CHECK(ncmp(ul_factor(&u), 15.0) == 0);
+		CHECK(u.exps[U_SECOND] == 1 && u.exps[U_METER] == 1);
+	END_TEST
+
+	TEST
+		// a refused redefinition keeps the old rule and its users
+		unit_t u;
+		CHECK(ul_parse_rule("Qa = 2 m"));
+		CHECK(ul_parse_rule("Qb = 3 Qa"));
+		CHECK(ul_parse_rule("!Qa = 2 Qb") == false);
+		CHECK(ul_parse("Qa", &u));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(ncmp(ul_factor(&u), 2.0) == 0 && u.exps[U_METER] == 1);
+		CHECK(ul_parse("Qb", &u));
+		CHECK(ncmp(ul_factor(&u), 6.0) == 0 && u.exps[U_METER] == 1);
+
+		CHECK(ul_parse_rule("!Qa = 5 s"));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(ul_parse("Qb", &u));
+		CHECK(ncmp(ul_factor(&u), 15.0) == 0);
+		CHECK(u.exps[U_SECOND] == 1 && u.exps[U_METER] == 0);
+
+		// Qd is out of range with the new Qa, Qc stays too
+		CHECK(ul_parse_rule("Qc = 2 Qa"));
+		CHECK(ul_parse_rule("Qd = Qa s^32000"));
+		CHECK(ul_parse_rule("!Qa = s^1000") == false);
+		CHECK(ul_parse("Qa", &u));
+		CHECK(ncmp(ul_factor(&u), 5.0) == 0 && u.exps[U_SECOND] == 1);
+		CHECK(ul_parse("Qc", &u));
+		CHECK(ncmp(ul_factor(&u), 10.0) == 0 && u.exps[U_SECOND] == 1);
 	END_TEST
 
 	TEST
 		static char prefs[] = "YZEPTGMkh dcmunpfazy";
 		static ul_number factors[] = {
-			1e24, 1e21, 1e18, 1e15, 1e12, 1e9, 1e6, 1e3, 1e2, 1,
-			1e-1, 1e-2, 1e-3, 1e-6, 1e-9, 1e-12, 1e-15, 1e-18, 1e-21, 1e-24,
+			NUM(1e24), NUM(1e21), NUM(1e18), NUM(1e15), NUM(1e12), NUM(1e9),
+			NUM(1e6), NUM(1e3), NUM(1e2), 1, NUM(1e-1), NUM(1e-2), NUM(1e-3),
+			NUM(1e-6), NUM(1e-9), NUM(1e-12), NUM(1e-15), NUM(1e-18), NUM(1e-21),
+			NUM(1e-24),
 		};
 
 		size_t num_prefs = strlen(prefs);
@@ -212,7 +316,7 @@ TEST_SUITE(parser)
 			FAIL_MSG("Failed to parse: '%s' (%s)", expr, ul_error());
 
 			CHECK(ncmp(ul_factor(&u), 5 * factors[i]) == 0);
-			FAIL_MSG("Factor: %g instead of %g (%c)", ul_factor(&u), 5 * factors[i], prefs[i]);
+			FAIL_MSG("Factor: %g instead of %g (%c)", (double)ul_factor(&u), (double)(5 * factors[i]), prefs[i]);
 
 			// check kilogram, the only base unit with a prefix
 			snprintf(expr, 128, "%cg", prefs[i]);
@@ -220,6 +324,152 @@ TEST_SUITE(parser)
 		}
 	END_TEST
 
+	TEST
+		// exact symbols win over prefix + symbol
+		CHECK(ul_parse_rule("min = 60 s"));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(ul_parse_rule("in = 0.0254 m"));
+		FAIL_MSG("Error: %s", ul_error());
+
+		unit_t u;
+		CHECK(ul_parse("min", &u));
+		CHECK(u.exps[U_SECOND] == 1 && u.exps[U_METER] == 0);
+		CHECK(ncmp(ul_factor(&u), 60.0) == 0);
+
+		CHECK(ul_parse("kin^2", &u));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(u.exps[U_METER] == 2);
+		CHECK(rcmp(ul_factor(&u), NUM(25.4) * NUM(25.4)) == 0);
+
+		CHECK(ul_parse("mm", &u));
+		CHECK(u.exps[U_METER] == 1);
+		CHECK(ncmp(ul_factor(&u), 1e-3) == 0);
+
+		CHECK(!ul_parse("mi", &u));
+		CHECK(!ul_parse("Nothing", &u));
+		CHECK(!ul_parse("km^", &u));
+	END_TEST
+
+	TEST
+		// more symbols than the static trie holds, sharing their first
+		// characters, and a failed rule takes its nodes back out
+		char sym[32];
+		int wrong = 0;
+		for (int i=0; i < 200; ++i) {
+			snprintf(sym, sizeof(sym), "Tr%c%c = %d m", 'a' + i % 26, 'a' + i / 26, i + 1);
+			wrong += !ul_parse_rule(sym);
+		}
+		CHECK(wrong == 0);
+		CHECK(!ul_parse_rule("TrzzLonger = 2 Unknown"));
+
+		unit_t u;
+		for (int i=0; i < 200; ++i) {
+			snprintf(sym, sizeof(sym), "Tr%c%c", 'a' + i % 26, 'a' + i / 26);
+			wrong += !ul_parse(sym, &u) || ncmp(ul_factor(&u), i + 1) != 0;
+		}
+		CHECK(wrong == 0);
+		CHECK(!ul_parse("Trzz", &u));
+		CHECK(!ul_parse("TrzzLonger", &u));
+	END_TEST
+
+	TEST
+		ul_cache_stats_t stats;
+		ul_cache_stats(&stats, true);
+
+		unit_t u;
+		CHECK(!ul_parse("5 Vendor^2", &u));
+		CHECK(strstr(ul_error(), "'Vendor'") != NULL);
+		FAIL_MSG("Error: %s", ul_error());
+
+		CHECK(!ul_parse("Vendor", &u));
+		CHECK(strstr(ul_error(), "'Vendor'") != NULL);
+		FAIL_MSG("Error: %s", ul_error());
+
+		ul_cache_stats(&stats, true);
+		CHECK(stats.hits == 1);
+		CHECK(stats.inserts == 1);
+
+		// new rules invalidate the cache
+		CHECK(ul_parse_rule("Vendor = 2 kg"));
+		CHECK(ul_parse("Vendor", &u));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(ncmp(ul_factor(&u), 2.0) == 0);
+
+		ul_cache_stats(&stats, false);
+		CHECK(stats.hits == 0);
+		CHECK(stats.flushes == 1);
+
+		// a cached miss gives the same error as the first one
+		char first[256];
+		CHECK(!ul_parse("kWidget", &u));
+		snprintf(first, sizeof(first), "%s", ul_error());
+		CHECK(strstr(first, "'Widget' with prefix k") != NULL);
+		FAIL_MSG("Error: %s", first);
+		CHECK(!ul_parse("kWidget", &u));
+		CHECK(strcmp(ul_error(), first) == 0);
+		FAIL_MSG("Cached: %s, first: %s", ul_error(), first);
+	END_TEST
+
+	TEST
+		// quoted errors are cut to the buffer, the quotes and the NUL fit
+		extern void _ul_set_error_quoted(ul_errkind_t kind, const char *func, int line,
+		                                 const char *msg, const char *str, size_t len, const char *after);
+		static char msg[2048];
+		memset(msg, 'm', sizeof(msg) - 1);
+		msg[1000] = '\0'; // "[f:1] " + msg + 'symbol0123' + after takes 1024
+		_ul_set_error_quoted(UL_ERR_SYMBOL, "f", 1, msg, "symbol0123", 10, "after!");
+		const char *err = ul_error();
+		CHECK(strlen(err) == 1023);
+		FAIL_MSG("Length %zu", strlen(err));
+		CHECK(strcmp(err + 1006, "'symbol0123'after") == 0);
+
+		msg[1000] = 'm';
+		_ul_set_error_quoted(UL_ERR_SYMBOL, "f", 1, msg, "symbol", 6, "");
+		err = ul_error();
+		CHECK(strlen(err) == 1023 && strcmp(err + 1021, "''") == 0);
+	END_TEST
+
+	TEST
+		// prefix powers are exact
+		unit_t u;
+		CHECK(ul_parse("5 km^2", &u));
+		CHECK(ul_factor(&u) == NUM(5e6));
+		FAIL_MSG("Factor: %g", (double)ul_factor(&u));
+
+		CHECK(ul_parse("ps^-2", &u));
+		CHECK(ul_factor(&u) == NUM(1e24));
+		FAIL_MSG("Factor: %g", (double)ul_factor(&u));
+
+		CHECK(ul_parse("um^3", &u));
+		CHECK(ul_factor(&u) == NUM(1e-18));
+		FAIL_MSG("Factor: %g", (double)ul_factor(&u));
+
+		CHECK(ul_parse("(2 m)^-3 / 4", &u));
+		CHECK(ul_factor(&u) == 1 / 32.0);
+		FAIL_MSG("Factor: %g", (double)ul_factor(&u));
+		CHECK(u.exps[U_METER] == -3);
+	END_TEST
+
+	TEST
+		// factors that differ by tiny amounts are not equal
+		unit_t a, b;
+		CHECK(ul_parse("1 km", &a));
+		CHECK(ul_parse("1000 m", &b));
+		CHECK(ul_equal(&a, &b));
+
+		CHECK(ul_parse("ps^-2 Tm", &a));
+		CHECK(ul_parse("1e36 m s^-2", &b));
+		CHECK(ul_equal(&a, &b));
+
+#ifdef UL_HAS_DECIMAL_EXPONENT
+		CHECK(ul_parse("1 ns", &a));
+		CHECK(ul_parse("2 ns", &b));
+		CHECK(!ul_equal(&a, &b));
+		CHECK(a.scale == -9);
+		CHECK(a.factor == 1.0);
+#endif
+	END_TEST
+
 	TEST
 		unit_t correct = MAKE_UNIT(1.0, U_KILOGRAM, 1, U_SECOND, -1);
 
@@ -234,6 +484,82 @@ TEST_SUITE(parser)
 		CHECK(ul_equal(&test, &correct));
 	END_TEST
 
+	GROUP("number")
+		TEST
+			extern bool _ul_parse_number(const char *str, ul_number *n);
+
+			const char *numbers[] = {
+				"0", "1", "-1", "+2", "0.75", ".5", "5.", "9.81", "1e3", "1E-3",
+				"6.02214076e23", "1.380649e-23", "0.1", "123456789012345678",
+				"12345678901234567890123", "0.000000000000000000000000001",
+				"2.2250738585072014e-308", "1.7976931348623157e308", "4.9e-324",
+				"3.14159265358979323846264338327950288", "12e25", "1e-400",
+				NULL
+			};
+
+			for (int i=0; numbers[i]; ++i) {
+				ul_number n = 0.0;
+				CHECK(_ul_parse_number(numbers[i], &n));
+				FAIL_MSG("Failed to parse '%s'", numbers[i]);
+				CHECK(n == _strton(numbers[i], NULL));
+				FAIL_MSG("'%s' parsed as " N_FMT, numbers[i], n);
+			}
+
+			const char *invalid[] = {
+				"", "-", ".", "e5", "1e", "1e+", "1.2.3", "1,5", "0x10", "inf", "nan", "5kg",
+				NULL
+			};
+			for (int i=0; invalid[i]; ++i) {
+				ul_number n;
+				CHECK(!_ul_parse_number(invalid[i], &n));
+				FAIL_MSG("'%s' is not a number", invalid[i]);
+			}
+		END_TEST
+
+		TEST
+			const char *locales[] = {"de_DE.UTF-8", "de_DE", "fr_FR.UTF-8", "German", NULL};
+			const char *old = setlocale(LC_NUMERIC, NULL);
+			char saved[64];
+			snprintf(saved, 64, "%s", old ? old : "C");
+
+			int i;
+			for (i=0; locales[i]; ++i) {
+				if (!setlocale(LC_NUMERIC, locales[i]))
+					continue;
+
+				unit_t u;
+				CHECK(ul_parse("0.75 m", &u));
+				FAIL_MSG("Error in locale %s: %s", locales[i], ul_error());
+				CHECK(ncmp(ul_factor(&u), 0.75) == 0);
+
+				// slow path
+				CHECK(ul_parse("3.14159265358979323846264338327950288 m", &u));
+				CHECK(ncmp(ul_factor(&u), 3.14159265358979323846) == 0);
+				break;
+			}
+			setlocale(LC_NUMERIC, saved);
+			if (!locales[i])
+				SKIP_TEST(); // none of them is installed
+		END_TEST
+
+		TEST
+			// the slow path translates the decimal point, without depending
+			// on the installed locales
+			extern bool _ul_localize_number(const char *str, const char *point, char *buffer, size_t size);
+			char buffer[16];
+			CHECK(_ul_localize_number("-3.25e2", ",", buffer, sizeof(buffer)));
+			CHECK(strcmp(buffer, "-3,25e2") == 0);
+			CHECK(_ul_localize_number("0.5", "\xd9\xab", buffer, sizeof(buffer)));
+			CHECK(strcmp(buffer, "0\xd9\xab" "5") == 0);
+			CHECK(_ul_localize_number("125", ",", buffer, sizeof(buffer)));
+			CHECK(strcmp(buffer, "125") == 0);
+
+			CHECK(_ul_localize_number("1234567.89012345", ",", buffer, sizeof(buffer)) == false);
+			CHECK(_ul_localize_number("123456.89012345", ",", buffer, sizeof(buffer)));
+			CHECK(_ul_localize_number("123456.89012345", "\xd9\xab", buffer, sizeof(buffer)) == false);
+		END_TEST
+	END_GROUP()
+
 	GROUP("extended")
 		TEST
 			unit_t kg = MAKE_UNIT(2.0, U_KILOGRAM, 1);
@@ -347,6 +673,104 @@ TEST_SUITE(core)
 		CHECK(ul_mult(&test, -1));
 		CHECK(ul_factor(&test) == -1.0);
 	END_TEST
+
+#ifndef UL_NO_DEBUG
+	TEST
+		const char *path = "test/utest-ring.log";
+		ul_debugout(path, false);
+		CHECK(ul_debugbuffer(256, true));
+
+		unit_t u;
+		for (int i=0; i < 50; ++i)
+			CHECK(ul_parse("5 kg m s^-2", &u));
+
+		// nothing written before the flush
+		FILE *f = fopen(path, "r");
+		CHECK(f != NULL);
+		char line[1024];
+		if (f) {
+			CHECK(fgets(line, 1024, f) != NULL);
+			CHECK(fgets(line, 1024, f) == NULL);
+			fclose(f);
+		}
+
+		// only the last messages, and only whole ones
+		ul_debugflush();
+		f = fopen(path, "r");
+		CHECK(f != NULL);
+		if (f) {
+			size_t total = 0;
+			CHECK(fgets(line, 1024, f) != NULL);
+			while (fgets(line, 1024, f)) {
+				CHECK(line[0] == '[');
+				CHECK(line[strlen(line) - 1] == '\n');
+				total += strlen(line);
+			}
+			CHECK(total > 0 && total <= 256);
+			fclose(f);
+		}
+
+		// messages larger than the buffer are cut to its size
+		ul_debugout(path, false);
+		CHECK(ul_debugbuffer(16, true));
+		CHECK(ul_parse("5 kg m s^-2", &u));
+		ul_debugflush();
+		f = fopen(path, "r");
+		CHECK(f != NULL);
+		if (f) {
+			CHECK(fgets(line, 1024, f) != NULL);
+			CHECK(fgets(line, 1024, f) != NULL);
+			CHECK(strlen(line) == 16 && line[15] == '\n');
+			FAIL_MSG("Line: '%s'", line);
+			CHECK(fgets(line, 1024, f) == NULL);
+			fclose(f);
+		}
+
+		// messages cut to the message buffer still end a line, so dropping
+		// the oldest ones keeps whole lines
+		static char longunit[1500];
+		memset(longunit, ' ', 1400);
+		strcpy(longunit + 1400, "5 kg"); // logged in one message
+		ul_debugout(path, false);
+		CHECK(ul_debugbuffer(4096, true));
+		for (int i=0; i < 10; ++i) {
+			CHECK(ul_parse(longunit, &u));
+			CHECK(ul_parse("5 kg m s^-2", &u));
+		}
+		ul_debugflush();
+		f = fopen(path, "r");
+		CHECK(f != NULL);
+		if (f) {
+			CHECK(fgets(line, 1024, f) != NULL);
+			while (fgets(line, 1024, f)) {
+				CHECK(line[0] == '[' && line[strlen(line) - 1] == '\n');
+				FAIL_MSG("Line: '%.60s'", line);
+			}
+			fclose(f);
+		}
+
+		// no messages of disabled categories
+		ul_debuglevel(UL_DBG_PARSER, UL_DBG_INFO);
+		ul_debuglevel(UL_DBG_NUMBER, UL_DBG_OFF);
+		ul_debugbuffer(0, false);
+		ul_debugout(path, false);
+		CHECK(ul_parse("5 kg", &u));
+		ul_debugflush();
+		f = fopen(path, "r");
+		CHECK(f != NULL);
+		if (f) {
+			int lines = 0;
+			while (fgets(line, 1024, f))
+				lines++;
+			CHECK(lines == 2); // header and "Parse unit"
+			fclose(f);
+		}
+
+		ul_debugging(true);
+		ul_debugout("test/utest-debug.log", true);
+		remove(path);
+	END_TEST
+#endif
 END_TEST_SUITE()
 
 TEST_SUITE(format)
@@ -508,6 +932,765 @@ TEST_SUITE(reduce)
 		CHECK(ul_snprint(buffer, 128, &N, UL_FMT_LATEX_FRAC, UL_FOP_REDUCE));
 		CHECK(strcmp(buffer, "$1 \\text{ N}$") == 0);
 	END_TEST
+	TEST
+		CHECK(ul_parse_rule("Rdc = 2 kg m^3"));
+		unit_t u;
+		CHECK(ul_parse("5 kg m^3", &u));
+		CHECK(ul_reduceable(&u));
+		CHECK(ul_parse("5 kg m^4", &u));
+		CHECK(!ul_reduceable(&u));
+		CHECK(!ul_reduceable(NULL));
+	END_TEST
+	TEST
+		// the first rule with the exponents wins
+		CHECK(ul_parse_rule("IdxFirst = 2 kg^3 m^5"));
+		CHECK(ul_parse_rule("IdxSecond = 3 kg^3 m^5"));
+		unit_t u = MAKE_UNIT(1, U_KILOGRAM, 3, U_METER, 5);
+		unit_t v = MAKE_UNIT(1, U_KILOGRAM, 3, U_METER, 6);
+		char buffer[128];
+		CHECK(ul_snprint(buffer, 128, &u, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxFirst") == 0);
+		FAIL_MSG("Result was: %s", buffer);
+
+		CHECK(ul_parse_rule("!IdxFirst = 2 kg^3 m^6"));
+		CHECK(ul_snprint(buffer, 128, &u, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxSecond") == 0);
+		FAIL_MSG("Result was: %s", buffer);
+		CHECK(ul_snprint(buffer, 128, &v, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxFirst") == 0);
+
+		// enough rules to grow the index a few times
+		for (int i=1; i <= 200; ++i) {
+			char rule[64];
+			snprintf(rule, sizeof(rule), "IdxMany%c%c = kg^%d s^7", 'a' + i % 26, 'a' + i / 26, i);
+			CHECK(ul_parse_rule(rule));
+		}
+		unit_t w = MAKE_UNIT(1, U_KILOGRAM, 150, U_SECOND, 7);
+		CHECK(ul_snprint(buffer, 128, &w, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxManyuf") == 0);
+		FAIL_MSG("Result was: %s", buffer);
+		w.exps[U_SECOND] = 8;
+		CHECK(ul_snprint(buffer, 128, &w, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxManyuf") != 0);
+
+		// users of a redefined rule move in the index, in order of definition
+		CHECK(ul_parse_rule("IdxBase = 2 m^9"));
+		CHECK(ul_parse_rule("IdxUser = 2 IdxBase s"));
+		CHECK(ul_parse_rule("IdxOther = 3 m^9 s"));
+		CHECK(ul_parse_rule("IdxLater = 3 m^10 s"));
+		CHECK(ul_parse_rule("!IdxBase = 2 m^10"));
+		unit_t x = MAKE_UNIT(1, U_METER, 9, U_SECOND, 1);
+		CHECK(ul_snprint(buffer, 128, &x, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxOther") == 0);
+		FAIL_MSG("Result was: %s", buffer);
+		x.exps[U_METER] = 10;
+		CHECK(ul_snprint(buffer, 128, &x, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxUser") == 0);
+		FAIL_MSG("Result was: %s", buffer);
+
+		// IdxBig would get out of range, so nothing moves
+		CHECK(ul_parse_rule("IdxRoot = 2 m^5 s^3"));
+		CHECK(ul_parse_rule("IdxLeaf = IdxRoot kg"));
+		CHECK(ul_parse_rule("IdxBig = IdxRoot^3000"));
+		CHECK(!ul_parse_rule("!IdxRoot = 2 m^11 s^3"));
+		unit_t y = MAKE_UNIT(1, U_METER, 5, U_KILOGRAM, 1, U_SECOND, 3);
+		CHECK(ul_snprint(buffer, 128, &y, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 IdxLeaf") == 0);
+		FAIL_MSG("Result was: %s", buffer);
+	END_TEST
+END_TEST_SUITE()
+
+TEST_SUITE(intern)
+	TEST
+		unit_t a, b;
+		CHECK(ul_parse("kg m s^-2", &a));
+		CHECK(ul_parse("m kg / s^2", &b));
+
+		ul_unit_id ida = ul_intern(&a);
+		ul_unit_id idb = ul_intern(&b);
+		CHECK(ida != UL_NO_UNIT);
+		CHECK(ida == idb);
+
+		CHECK(ul_parse("2 kg m s^-2", &b));
+		idb = ul_intern(&b);
+		CHECK(idb != UL_NO_UNIT);
+		CHECK(ida != idb);
+
+		CHECK(ul_equal(ul_unit(ida), &a));
+		CHECK(ul_equal(ul_unit(idb), &b));
+		CHECK(ul_unit(UL_NO_UNIT) == NULL);
+		CHECK(ul_unit(idb + 1000) == NULL);
+
+		// many units, ids must stay stable while the table grows
+		const unit_t *ua = ul_unit(ida);
+		for (int i=0; i < 1000; ++i) {
+			unit_t u = MAKE_UNIT(i, U_METER, i % 7);
+			ul_unit_id id = ul_intern(&u);
+			CHECK(id != UL_NO_UNIT && ul_equal(ul_unit(id), &u));
+		}
+		CHECK(ul_intern(&a) == ida);
+		CHECK(ul_unit(ida) == ua);
+	END_TEST
+
+	TEST
+		unit_t u = MAKE_UNIT(1, U_KILOGRAM, 1, U_SECOND, -1, U_AMPERE, 3);
+		ul_unit_id id = ul_intern(&u);
+
+		CHECK(ul_unit_symbol(id) == NULL);
+		const char *str = ul_unit_string(id, UL_FMT_PLAIN, UL_FOP_REDUCE);
+		CHECK(str && strcmp(str, "1 kg s^-1 A^3") == 0);
+		FAIL_MSG("str: '%s'", str);
+		CHECK(ul_unit_string(id, UL_FMT_PLAIN, UL_FOP_REDUCE) == str);
+
+		// the cached symbol and strings follow the rules
+		CHECK(ul_parse_rule("InternTest = kg s^-1 A^3"));
+		CHECK(ul_unit_symbol(id) && strcmp(ul_unit_symbol(id), "InternTest") == 0);
+		str = ul_unit_string(id, UL_FMT_PLAIN, UL_FOP_REDUCE);
+		CHECK(str && strcmp(str, "1 InternTest") == 0);
+		FAIL_MSG("str: '%s'", str);
+
+		str = ul_unit_string(id, UL_FMT_LATEX_FRAC, 0);
+		CHECK(str && strcmp(str, "$\\frac{1 \\text{ kg} \\text{ A}^{3}}{\\text{s}}$") == 0);
+		FAIL_MSG("str: '%s'", str);
+	END_TEST
+
+	TEST
+		// NaN never equals itself, the unit still gets one id
+		unit_t nan = MAKE_UNIT(NAN, U_METER, 1);
+		ul_unit_id id = ul_intern(&nan);
+		CHECK(id != UL_NO_UNIT && ul_intern(&nan) == id);
+
+		// the symbol stays valid after the rule set it came from is freed
+		ul_ruleset_t *old = ul_ruleset_current();
+		ul_ruleset_t *set = ul_ruleset_new();
+		CHECK(ul_ruleset_parse_rule(set, "InternSwap = kg^5 A"));
+		CHECK(ul_ruleset_swap(set));
+		ul_ruleset_free(set);
+
+		unit_t u = MAKE_UNIT(1, U_KILOGRAM, 5, U_AMPERE, 1);
+		id = ul_intern(&u);
+		const char *sym = ul_unit_symbol(id);
+		CHECK(sym && strcmp(sym, "InternSwap") == 0);
+		CHECK(ul_ruleset_swap(old));
+		ul_ruleset_free(old);
+		CHECK(sym && strcmp(sym, "InternSwap") == 0);
+		CHECK(ul_unit_symbol(id) == NULL);
+	END_TEST
+END_TEST_SUITE()
+
+TEST_SUITE(encode)
+	TEST
+		unit_t units[] = {
+			MAKE_UNIT(1.0, U_METER, 1),
+			MAKE_UNIT(9.81, U_METER, 1, U_SECOND, -2),
+			MAKE_UNIT(-0.5, U_KILOGRAM, 1000000, U_LEMMING, -70000),
+			MAKE_UNIT(1e-300, U_CANDELA, 3),
+			MAKE_UNIT(0.0),
+		};
+		const int num = sizeof(units) / sizeof(units[0]);
+
+		uint8_t buffer[num * UL_ENCODED_MAX];
+		size_t len = 0;
+		for (int i=0; i < num; ++i) {
+			size_t n = ul_encode(&units[i], buffer + len, UL_ENCODED_MAX);
+			CHECK(n > 0 && n <= UL_ENCODED_MAX);
+			FAIL_MSG("Error: %s", ul_error());
+
+			unit_t u;
+			CHECK(ul_decode(buffer + len, n, &u) == n);
+			FAIL_MSG("Error: %s", ul_error());
+			CHECK(memcmp(u.exps, units[i].exps, sizeof(u.exps)) == 0);
+			CHECK(ul_factor(&u) == ul_factor(&units[i]));
+			len += n;
+		}
+		// plain units are small
+		CHECK(ul_encode(&units[0], buffer, UL_ENCODED_MAX) == 3);
+
+		unit_t decoded[8];
+		size_t used = 0;
+		CHECK(ul_decode_all(buffer, len, decoded, 8, &used) == (size_t)num);
+		CHECK(used == len);
+		for (int i=0; i < num; ++i)
+			CHECK(ul_cmp(&decoded[i], &units[i]) == UL_EQUAL);
+
+		CHECK(ul_decode_all(buffer, len, decoded, 2, &used) == 2);
+		CHECK(used < len);
+	END_TEST
+
+	TEST
+		unit_t N = MAKE_UNIT(2.5, U_KILOGRAM, 1, U_METER, 1, U_SECOND, -2);
+		uint8_t buffer[UL_ENCODED_MAX];
+		size_t len = ul_encode(&N, buffer, sizeof(buffer));
+		CHECK(len > 0);
+
+		unit_t u;
+		for (size_t i=0; i < len; ++i) {
+			CHECK(ul_decode(buffer, i, &u) == 0);
+		}
+		CHECK(ul_encode(&N, buffer, len - 1) == 0);
+
+		buffer[0] = (buffer[0] & 0x0F) | 0xF0;
+		CHECK(ul_decode(buffer, len, &u) == 0);
+		PASS_MSG("Error: %s", ul_error());
+
+		CHECK(ul_encode(NULL, buffer, len) == 0);
+		CHECK(ul_decode(NULL, len, &u) == 0);
+	END_TEST
+END_TEST_SUITE()
+
+TEST_SUITE(stats)
+	TEST
+		ul_stats_t stats;
+		ul_stats(&stats, true);
+
+		unit_t u;
+		CHECK(ul_parse("5 km^2 / s", &u));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(!ul_parse("Nonsense", &u));
+		CHECK(!ul_parse(NULL, &u));
+
+		ul_stats(&stats, false);
+		CHECK(stats.parse_calls == 3);
+		CHECK(stats.tokens == 5);
+		CHECK(stats.rule_lookups == 3);
+		CHECK(stats.rule_misses == 1);
+		CHECK(stats.prefix_lookups == 1);
+		CHECK(stats.errors[UL_ERR_SYMBOL] == 1);
+		CHECK(stats.errors[UL_ERR_PARAM] == 1);
+		CHECK(stats.errors[UL_ERR_SYNTAX] == 0);
+	END_TEST
+
+	TEST
+		ul_stats_t stats;
+		ul_stats(&stats, true);
+
+		unit_t u = MAKE_UNIT(1.0, U_KILOGRAM, 1, U_METER, 1, U_SECOND, -2);
+		char buffer[128];
+		CHECK(ul_snprint(buffer, 128, &u, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 N") == 0);
+		CHECK(ul_snprint(buffer, 128, &u, UL_FMT_PLAIN, 0));
+		size_t len = strlen(buffer);
+
+		ul_stats(&stats, true);
+		CHECK(stats.format_calls == 2);
+		CHECK(stats.format_bytes == len + 3);
+		CHECK(stats.reduce_calls == 1);
+		CHECK(stats.reduce_hits == 1);
+
+		// reset starts from zero
+		ul_stats(&stats, false);
+		CHECK(stats.format_calls == 0);
+		CHECK(stats.parse_calls == 0);
+	END_TEST
+
+	TEST
+		ul_memory_t before, after;
+		ul_memory_usage(&before);
+		CHECK(before.rules > 0 && before.prefixes > 0 && before.index > 0);
+		CHECK(before.total == before.rules + before.symbols + before.prefixes +
+		      before.index + before.cache + before.units + before.other);
+
+		// short symbols are stored in the rule itself
+		CHECK(ul_parse_rule("Memtest = 2 m"));
+		ul_memory_usage(&after);
+		CHECK(after.rules >= before.rules);
+		CHECK(after.symbols == before.symbols);
+		CHECK(after.prefixes == before.prefixes);
+
+		// longer ones go to the string pool
+		CHECK(ul_parse_rule("Memtestwithalongsymbol = 3 Memtest"));
+		ul_memory_usage(&after);
+		CHECK(after.symbols >= strlen("Memtestwithalongsymbol") + 1);
+		CHECK(after.total >= before.total);
+
+		unit_t u;
+		CHECK(ul_parse("Memtestwithalongsymbol", &u));
+		CHECK(ncmp(u.factor, 6.0) == 0);
+		CHECK(ul_parse_rule("!Memtestwithalongsymbol = 4 m"));
+		CHECK(ul_parse("Memtestwithalongsymbol", &u));
+		CHECK(ncmp(u.factor, 4.0) == 0);
+	END_TEST
+
+	TEST
+		ul_latency_reset();
+		ul_latency_sampling(2);
+
+		unit_t u;
+		for (int i=0; i < 10; ++i)
+			CHECK(ul_parse("( 0.2 N^2 ) * 0.75 m^-1", &u));
+		char buffer[128];
+		CHECK(ul_snprint(buffer, 128, &u, UL_FMT_PLAIN, 0));
+		ul_latency_sampling(0);
+		CHECK(ul_parse("m", &u));
+
+		ul_latency_t lat;
+		CHECK(ul_latency(UL_LAT_PARSE, &lat));
+		CHECK(lat.count == 5);
+		CHECK(lat.min <= lat.p50 && lat.p50 <= lat.p99 && lat.p99 <= lat.max);
+		CHECK(lat.min <= lat.mean && lat.mean <= lat.max);
+		CHECK(ul_latency(UL_LAT_PRINT, &lat));
+		CHECK(lat.count == 1);
+		CHECK(ul_latency(UL_LAT_LOAD_RULES, &lat));
+		CHECK(lat.count == 0);
+
+		FILE *f = tmpfile();
+		CHECK(f != NULL);
+		if (f) {
+			CHECK(ul_latency_dump(f, true));
+			rewind(f);
+			char json[256];
+			CHECK(fgets(json, 256, f) && strcmp(json, "{\n") == 0);
+			const char *expect = "  \"parse\": {\"count\": 5,";
+			CHECK(fgets(json, 256, f) && strncmp(json, expect, strlen(expect)) == 0);
+			fclose(f);
+		}
+	END_TEST
+END_TEST_SUITE()
+
+struct alloc_count
+{
+	long allocs;
+	long frees;
+};
+
+static void *count_malloc(size_t size, void *user)
+{
+	((struct alloc_count *)user)->allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size, void *user)
+{
+	(void)user;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ptr, void *user)
+{
+	((struct alloc_count *)user)->frees++;
+	free(ptr);
+}
+
+TEST_SUITE(alloc)
+	TEST
+		struct alloc_count count = { 0, 0 };
+
+		// not while the memory of the old one is in use
+		CHECK(!ul_set_allocator(count_malloc, count_realloc, count_free, &count));
+		ul_ruleset_t *held = ul_ruleset_new();
+		CHECK(held && ul_ruleset_parse_rule(held, "Held = 2 m"));
+		ul_quit();
+		CHECK(!ul_set_allocator(count_malloc, count_realloc, count_free, &count));
+		FAIL_MSG("Allocator changed while a rule set is held");
+		ul_ruleset_free(held);
+
+		CHECK(!ul_set_allocator(count_malloc, NULL, count_free, &count));
+		CHECK(ul_set_allocator(count_malloc, count_realloc, count_free, &count));
+		ul_debugout("test/utest-debug.log", true);
+		CHECK(ul_init());
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(count.allocs == 0); // the default rules are static
+		FAIL_MSG("%ld allocations in ul_init", count.allocs);
+
+		CHECK(ul_parse_rule("N = kg m s^-2"));
+		CHECK(ul_parse_rule("J = N m"));
+		unit_t u;
+		CHECK(ul_parse("5 kJ", &u));
+		CHECK(ul_unit_string(ul_intern(&u), UL_FMT_PLAIN, UL_FOP_REDUCE) != NULL);
+		CHECK(count.allocs > 0);
+
+		// everything goes back to the allocator it came from
+		ul_quit();
+		CHECK(count.allocs == count.frees);
+		FAIL_MSG("%ld allocations, %ld frees", count.allocs, count.frees);
+
+		CHECK(ul_set_allocator(NULL, NULL, NULL, NULL));
+		ul_debugout("test/utest-debug.log", true);
+		CHECK(ul_init());
+		CHECK(count.allocs == count.frees);
+	END_TEST
+END_TEST_SUITE()
+
+TEST_SUITE(shared)
+	TEST
+		const char *path = "test/shared-rules.bin";
+		CHECK(ul_parse_rule("Shared = 3 kg m"));
+		CHECK(ul_parse_rule("SharedWithALongName = 2 Shared s^-1"));
+		CHECK(ul_publish_rules(path));
+		FAIL_MSG("Error: %s", ul_error());
+
+		unit_t u;
+		CHECK(ul_reset_rules());
+		CHECK(!ul_parse("Shared", &u));
+
+		CHECK(ul_attach_rules(path));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(ul_parse("SharedWithALongName", &u));
+		CHECK(ncmp(ul_factor(&u), 6.0) == 0);
+		CHECK(u.exps[U_SECOND] == -1);
+		CHECK(ul_parse("mShared", &u));
+		CHECK(ncmp(ul_factor(&u), 0.003) == 0);
+
+		unit_t v = MAKE_UNIT(1, U_KILOGRAM, 1, U_METER, 1, U_SECOND, -1);
+		char buffer[128];
+		CHECK(ul_snprint(buffer, 128, &v, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 SharedWithALongName") == 0);
+		FAIL_MSG("Result was: %s", buffer);
+
+		// attached rules are read only
+		CHECK(!ul_parse_rule("Other = 2 m"));
+		CHECK(!ul_parse_rule("!Shared = 2 m"));
+
+		// detach
+		CHECK(ul_reset_rules());
+		CHECK(!ul_parse("Shared", &u));
+		CHECK(ul_parse_rule("Other = 2 m"));
+
+		// not a published rule set
+		CHECK(!ul_attach_rules("etc/rules"));
+		CHECK(!ul_attach_rules("test/does-not-exist"));
+		CHECK(ul_parse("Other", &u));
+
+		// indices out of bounds, the file ends with the exponent index
+		CHECK(ul_publish_rules(path));
+		FILE *f = fopen(path, "r+b");
+		CHECK(f != NULL);
+		if (f) {
+			static const unsigned char junk[16] = {
+				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+			};
+			CHECK(fseek(f, -(long)sizeof(junk), SEEK_END) == 0);
+			CHECK(fwrite(junk, 1, sizeof(junk), f) == sizeof(junk));
+			fclose(f);
+		}
+		CHECK(!ul_attach_rules(path));
+		CHECK(ul_parse("Other", &u));
+
+		remove(path);
+	END_TEST
+END_TEST_SUITE()
+
+#ifdef HAS_PTHREAD
+// Looks up a symbol before and after the main thread swapped the rules
+struct cache_thread
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	int  step;          // 1 after the first lookups, 2 after the swap
+	bool before, after; // whether the symbol was known
+};
+
+static void wait_step(struct cache_thread *t, int step)
+{
+	pthread_mutex_lock(&t->lock);
+	while (t->step < step)
+		pthread_cond_wait(&t->cond, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void set_step(struct cache_thread *t, int step)
+{
+	pthread_mutex_lock(&t->lock);
+	t->step = step;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void *cache_thread(void *arg)
+{
+	struct cache_thread *t = arg;
+	unit_t u;
+	// a miss and a cache hit
+	t->before = ul_parse("CacheThread", &u) || ul_parse("CacheThread", &u);
+	set_step(t, 1);
+	wait_step(t, 2);
+	t->after = ul_parse("CacheThread", &u);
+	return NULL;
+}
+
+// Parses and prints until stop is set, while the main thread changes the rules
+struct reader_thread
+{
+	volatile int stop;
+	bool         ok;
+	unsigned     reads;
+};
+
+static void *reader_thread(void *arg)
+{
+	struct reader_thread *t = arg;
+	unit_t u;
+	char buffer[128];
+	while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+		if (!ul_parse("kg m^2 s^-2", &u) || !ul_snprint(buffer, sizeof(buffer), &u, UL_FMT_PLAIN, UL_FOP_REDUCE))
+			t->ok = false;
+		ul_parse("Reader", &u);
+		t->reads++;
+	}
+	return NULL;
+}
+#endif
+
+TEST_SUITE(ruleset)
+	TEST
+		unit_t u;
+		CHECK(ul_parse_rule("Old = 2 m"));
+		ul_ruleset_t *old = ul_ruleset_current();
+		CHECK(old != NULL);
+
+		// build a new set off to the side, the current one stays usable
+		ul_ruleset_t *set = ul_ruleset_new();
+		CHECK(set != NULL);
+		CHECK(ul_ruleset_parse_rule(set, "New = 3 s"));
+		CHECK(ul_ruleset_parse_rule(set, "Newer = 2 New"));
+		CHECK(!ul_ruleset_parse_rule(set, "Broken = Old"));
+		CHECK(ul_ruleset_load_rules(set, "etc/rules"));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(ul_parse("Old", &u));
+		CHECK(!ul_parse("New", &u));
+
+		CHECK(ul_ruleset_swap(set));
+		CHECK(ul_parse("Newer", &u));
+		CHECK(ncmp(ul_factor(&u), 6.0) == 0);
+		CHECK(u.exps[U_SECOND] == 1);
+		CHECK(!ul_parse("Old", &u));
+
+		unit_t s = MAKE_UNIT(1, U_SECOND, 1);
+		char buffer[128];
+		CHECK(ul_snprint(buffer, 128, &s, UL_FMT_PLAIN, UL_FOP_REDUCE));
+		CHECK(strcmp(buffer, "1 s") == 0);
+
+		// the old set lives as long as it's referenced
+		CHECK(ul_ruleset_parse_rule(old, "Older = 2 Old"));
+		ul_ruleset_free(old);
+
+		// ul_parse_rule changes the current set
+		CHECK(ul_parse_rule("Newest = 2 Newer"));
+		ul_ruleset_t *cur = ul_ruleset_current();
+		CHECK(cur == set);
+		CHECK(!ul_ruleset_parse_rule(cur, "Newest = 1 s"));
+		ul_ruleset_free(cur);
+		ul_ruleset_free(set);
+		CHECK(ul_parse("Newest", &u));
+		CHECK(ncmp(ul_factor(&u), 12.0) == 0);
+
+		CHECK(!ul_ruleset_swap(NULL));
+		CHECK(!ul_ruleset_parse_rule(NULL, "X = m"));
+	END_TEST
+
+#ifdef HAS_PTHREAD
+	TEST
+		// the cache counters of all threads are summed up, and no thread
+		// keeps unknown symbols of an older set
+		ul_cache_stats_t stats;
+		ul_cache_stats(&stats, true);
+
+		struct cache_thread t = {
+			PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, true, false,
+		};
+		pthread_t thread;
+		FATAL(pthread_create(&thread, NULL, cache_thread, &t) != 0);
+		wait_step(&t, 1);
+		CHECK(!t.before);
+		ul_cache_stats(&stats, false);
+		CHECK(stats.hits == 1 && stats.inserts == 1);
+		FAIL_MSG("%lu hits, %lu inserts", stats.hits, stats.inserts);
+
+		ul_ruleset_t *set = ul_ruleset_new();
+		CHECK(set != NULL);
+		CHECK(ul_ruleset_parse_rule(set, "CacheThread = 2 m"));
+		CHECK(ul_ruleset_swap(set));
+		ul_ruleset_free(set);
+		set_step(&t, 2);
+		pthread_join(thread, NULL);
+		CHECK(t.after);
+	END_TEST
+	TEST
+		// the rules change and get replaced while another thread reads
+		// them, it never sees freed or half changed rules
+		const char *path = "test/reader-rules.bin";
+		CHECK(ul_reset_rules());
+		CHECK(ul_parse_rule("Reader = 2 kg m^2"));
+		CHECK(ul_publish_rules(path));
+
+		struct reader_thread t = { 0, true, 0 };
+		pthread_t thread;
+		FATAL(pthread_create(&thread, NULL, reader_thread, &t) != 0);
+		for (int i=0; i < 50; ++i) {
+			CHECK(ul_reset_rules());
+			CHECK(ul_parse_rule("Reader = 3 kg m^2"));
+			CHECK(ul_parse_rule("!Reader = 4 kg m^2"));
+			CHECK(ul_load_rules("etc/rules"));
+			CHECK(ul_attach_rules(path));
+		}
+		__atomic_store_n(&t.stop, 1, __ATOMIC_RELEASE);
+		pthread_join(thread, NULL);
+		CHECK(t.ok);
+		FAIL_MSG("after %u reads", t.reads);
+
+		unit_t u;
+		CHECK(ul_parse("Reader", &u));
+		CHECK(ncmp(ul_factor(&u), 2.0) == 0);
+		CHECK(ul_reset_rules());
+		remove(path);
+	END_TEST
+#endif
+END_TEST_SUITE()
+
+static bool write_file(const char *path, const char *text)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return false;
+	fputs(text, f);
+	return fclose(f) == 0;
+}
+
+static bool same_file(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "rb");
+	FILE *fb = fopen(b, "rb");
+	bool same = fa && fb;
+	while (same) {
+		int ca = fgetc(fa);
+		same = ca == fgetc(fb);
+		if (ca == EOF)
+			break;
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return same;
+}
+
+// Loads path like ul_load_rules and with threads, both must give the same rules
+static bool load_both(const char *path, unsigned threads)
+{
+	const char *seq = "test/parallel-seq.bin";
+	const char *par = "test/parallel-par.bin";
+	bool ok = ul_reset_rules() && ul_load_rules(path) && ul_publish_rules(seq)
+	       && ul_reset_rules() && ul_load_rules_parallel(path, threads) && ul_publish_rules(par)
+	       && same_file(seq, par);
+	remove(seq);
+	remove(par);
+	return ok;
+}
+
+// Like load_both, but both have to fail and leave the same rules behind
+static bool fail_both(const char *path, unsigned threads)
+{
+	const char *seq = "test/parallel-seq.bin";
+	const char *par = "test/parallel-par.bin";
+	bool ok = ul_reset_rules() && !ul_load_rules(path) && ul_publish_rules(seq)
+	       && ul_reset_rules() && !ul_load_rules_parallel(path, threads) && ul_publish_rules(par)
+	       && same_file(seq, par);
+	remove(seq);
+	remove(par);
+	return ok;
+}
+
+TEST_SUITE(parallel)
+	TEST
+		const char *path = "test/parallel-rules.txt";
+		CHECK(write_file(path,
+			"# levels 0, 1, 2 and 3\n"
+			"N = kg m s^-2\n"
+			"\n"
+			"Pa = N m^-2\n"
+			"J = N m\n"
+			"W = J / s\n"
+			"   # comment\n"
+			"kWh = 3600 kW s\n"
+			"Hz = s^-1\n"
+			"ParallelLongSymbolName = 2 kWh Hz\n"));
+		CHECK(load_both(path, 4));
+		FAIL_MSG("Error: %s", ul_error());
+		CHECK(load_both(path, 0));
+		CHECK(load_both(path, 1));
+
+		unit_t u;
+		CHECK(ul_parse("ParallelLongSymbolName", &u));
+		CHECK(ncmp(ul_factor(&u), 7200000.0) == 0);
+		CHECK(u.exps[U_SECOND] == -3);
+		CHECK(ul_parse("mPa", &u));
+
+		// the same symbols again
+		CHECK(!ul_load_rules_parallel(path, 4));
+		CHECK(ul_parse("kWh", &u));
+		CHECK(ncmp(ul_factor(&u), 3600000.0) == 0);
+
+		// the workers record what the rules use, too
+		CHECK(ul_parse_rule("!N = 2 kg m s^-2"));
+		CHECK(ul_parse("ParallelLongSymbolName", &u));
+		CHECK(ncmp(ul_factor(&u), 14400000.0) == 0);
+
+		// the counters of ended worker threads are reused, so there are
+		// never more than one per worker
+		ul_memory_t before, after;
+		ul_memory_usage(&before);
+		for (int i=0; i < 20; ++i)
+			CHECK(load_both(path, 4));
+		ul_memory_usage(&after);
+		size_t block = sizeof(ul_stats_t) + sizeof(ul_cache_stats_t) + 3 * sizeof(void *);
+		CHECK(after.other - before.other <= 3 * block);
+		FAIL_MSG("%lu bytes before, %lu after", (unsigned long)before.other, (unsigned long)after.other);
+	END_TEST
+	TEST
+		// these are loaded sequentially, with the same result
+		const char *path = "test/parallel-rules.txt";
+		CHECK(write_file(path, "Foo = 2 m\n!Bar = 3 Foo\n"));
+		CHECK(load_both(path, 4));
+		CHECK(write_file(path, "Foo = 2 m\nBar = 3 Foo\n!Foo = 4 m\n"));
+		CHECK(load_both(path, 4));
+
+		// Baz doesn't exist yet when Foo is parsed
+		CHECK(write_file(path, "Foo = 2 Baz\nBaz = 3 m\n"));
+		CHECK(!load_both(path, 4));
+		CHECK(ul_reset_rules());
+		CHECK(!ul_load_rules_parallel(path, 4));
+		CHECK(strstr(ul_error(), "Baz") != NULL);
+		FAIL_MSG("Error: %s", ul_error());
+
+		// kBaz is kilo Baz while Baz exists, but not after kBaz is defined
+		CHECK(write_file(path, "Baz = 3 m\nFoo = kBaz\nkBaz = 2 m\n"));
+		CHECK(load_both(path, 4));
+		unit_t u;
+		CHECK(ul_parse("Foo", &u));
+		CHECK(ncmp(ul_factor(&u), 3000.0) == 0);
+
+		// everything before the error stays
+		CHECK(write_file(path, "Foo = 2 m\nBar = 3 Foo\nBaz = 2 Unknown\nQux = 2 s\n"));
+		CHECK(ul_reset_rules());
+		CHECK(!ul_load_rules_parallel(path, 4));
+		CHECK(ul_parse("Bar", &u));
+		CHECK(!ul_parse("Baz", &u));
+		CHECK(!ul_parse("Qux", &u));
+
+		// not even the trie nodes of the symbols after the error are left
+		CHECK(write_file(path, "Foo = 2 m\nBar = 3 Foo\nBaz = 2 Unknown\nQuxWithALongName = 2 s\n"));
+		CHECK(fail_both(path, 4));
+
+		// what the given up parallel load counted is dropped
+		ul_stats_t seq, par;
+		CHECK(ul_reset_rules());
+		ul_stats(&seq, true);
+		CHECK(!ul_load_rules(path));
+		ul_stats(&seq, true);
+		CHECK(ul_reset_rules());
+		ul_stats(&par, true);
+		CHECK(!ul_load_rules_parallel(path, 4));
+		ul_stats(&par, true);
+		CHECK(par.rule_lookups == seq.rule_lookups && par.tokens == seq.tokens);
+		FAIL_MSG("%lu lookups, %lu sequentially", par.rule_lookups, seq.rule_lookups);
+		CHECK(memcmp(par.errors, seq.errors, sizeof(seq.errors)) == 0);
+
+		CHECK(!ul_load_rules_parallel(NULL, 4));
+		CHECK(!ul_load_rules_parallel("test/does-not-exist", 4));
+		CHECK(ul_reset_rules());
+		remove(path);
+	END_TEST
 END_TEST_SUITE()
 
 int main(void)
@@ -527,6 +1710,13 @@ int main(void)
 	RUN_SUITE(parser);
 	RUN_SUITE(format);
 	RUN_SUITE(reduce);
+	RUN_SUITE(intern);
+	RUN_SUITE(encode);
+	RUN_SUITE(stats);
+	RUN_SUITE(alloc);
+	RUN_SUITE(shared);
+	RUN_SUITE(ruleset);
+	RUN_SUITE(parallel);
 
 	ul_quit();
 
@@ -599,10 +1789,17 @@ int main(void)
 
 // SINGLE TEST
 #define TEST \
-	{ int _id = ++_test_id; int _err = 0; int _cid = 0; bool _last = true; \
+	{ int _id = ++_test_id; int _err = 0; int _cid = 0; bool _last = true; bool _skip = false; \
+
+// Marks the test as skipped, it still runs to its end
+#define SKIP_TEST() \
+	do { _skip = true; } while (0)
 
 #define END_TEST \
-		if (_err > 0) { \
+		if (_skip && _err == 0) { \
+			PRINT(_o, L_NORMAL, "[%s%s-%d] skipped.\n", _name, _group_name, _id); \
+		} \
+		else if (_err > 0) { \
 			PRINT(_o, L_NORMAL, "[%s%s-%d] failed with %d error%s.\n", _name, _group_name, _id, _err, _err > 1 ? "s" : ""); \
 		} \
 		else { \